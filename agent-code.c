@@ -0,0 +1,201 @@
+/*
+ * Copyright (C) 2014 by Jérôme Pouiller <jezz@sysmic.org>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+/*
+ * Agent running on its own thread in the target. It is copied from our own
+ * memory to the target, so everything it needs has to live in the
+ * reredirect_agent section: no libc, no global data and no constant that the
+ * compiler could move to .rodata. Since it runs the same machine code as
+ * reredirect, the target has to use our own personality.
+ */
+#define _GNU_SOURCE
+#include <stddef.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <sys/syscall.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "reredirect.h"
+
+#ifdef __x86_64__
+
+#define __str(x) #x
+#define str(x) __str(x)
+
+#define AGENT __attribute__((section("reredirect_agent"), noinline, used))
+
+/* Our sockets are kept above the fds usually redirected */
+#define AGENT_FD_MIN 256
+
+/* CLONE_VM|CLONE_FS|CLONE_FILES|CLONE_SIGHAND|CLONE_THREAD|CLONE_SYSVSEM */
+#define AGENT_CLONE_FLAGS "0x50f00"
+
+_Static_assert(offsetof(struct agent_conf, stack) == AGENT_CONF_STACK, "agent_conf");
+_Static_assert(offsetof(struct agent_conf, tid) == AGENT_CONF_TID, "agent_conf");
+
+static inline __attribute__((always_inline))
+long sc(long nr, long a0, long a1, long a2, long a3, long a4) {
+    register long r10 asm("r10") = a3;
+    register long r8 asm("r8") = a4;
+    long ret;
+
+    asm volatile ("syscall"
+                  : "=a"(ret)
+                  : "a"(nr), "D"(a0), "S"(a1), "d"(a2), "r"(r10), "r"(r8)
+                  : "rcx", "r11", "memory");
+    return ret;
+}
+
+/*
+ * Entered by ptrace_run_code() with the agent_conf in rdi. The new thread
+ * starts on its own stack while the caller gives control back to us.
+ */
+asm(".pushsection reredirect_agent, \"ax\"\n"
+    ".globl agent_entry\n"
+    ".hidden agent_entry\n"
+    "agent_entry:\n"
+    "    mov %rdi, %r12\n"
+    "    mov $" AGENT_CLONE_FLAGS ", %edi\n"
+    "    mov " str(AGENT_CONF_STACK) "(%r12), %rsi\n"
+    "    xor %edx, %edx\n"
+    "    xor %r10d, %r10d\n"
+    "    xor %r8d, %r8d\n"
+    "    mov $" str(SYS_clone) ", %eax\n"
+    "    syscall\n"
+    "    test %rax, %rax\n"
+    "    jz 1f\n"
+    "    mov %rax, " str(AGENT_CONF_TID) "(%r12)\n"
+    "    int3\n"
+    "1:  mov %r12, %rdi\n"
+    "    call agent_main\n"
+    "    mov $" str(SYS_exit) ", %eax\n"
+    "    xor %edi, %edi\n"
+    "    syscall\n"
+    ".popsection\n");
+
+/* Move fd to AGENT_FD_MIN or above if the limit allows it */
+AGENT static int agent_high_fd(int fd) {
+    int high = sc(SYS_fcntl, fd, F_DUPFD_CLOEXEC, AGENT_FD_MIN, 0, 0);
+
+    if (high < 0)
+        return fd;
+    sc(SYS_close, fd, 0, 0, 0, 0);
+    return high;
+}
+
+/* Return 0 when the connection is closed and -1 to stop the agent */
+AGENT static int agent_request(int sock) {
+    union {
+        struct cmsghdr hdr;
+        char buf[CMSG_SPACE(sizeof(int))];
+    } control;
+    struct agent_request req;
+    struct agent_reply rep;
+    struct cmsghdr *cmsg;
+    struct msghdr msg;
+    struct iovec iov;
+    int fd;
+
+    iov.iov_base = &req;
+    iov.iov_len = sizeof(req);
+    msg.msg_name = NULL;
+    msg.msg_namelen = 0;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = &control;
+    msg.msg_controllen = sizeof(control);
+    msg.msg_flags = 0;
+    if (sc(SYS_recvmsg, sock, (long)&msg, MSG_CMSG_CLOEXEC, 0, 0) != sizeof(req))
+        return 0;
+    fd = req.fd;
+    cmsg = CMSG_FIRSTHDR(&msg);
+    if (cmsg && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+        fd = *(int *)CMSG_DATA(cmsg);
+    if (req.quit)
+        return -1;
+
+    rep.save_fd = -1;
+    if (req.save)
+        rep.save_fd = sc(SYS_dup, req.orig_fd, 0, 0, 0, 0);
+    rep.err = sc(SYS_dup2, fd, req.orig_fd, 0, 0, 0);
+    if (rep.err >= 0)
+        rep.err = 0;
+    if (fd != req.orig_fd)
+        sc(SYS_close, fd, 0, 0, 0, 0);
+    /* dup2() does not keep O_CLOEXEC */
+    if (!rep.err && (req.flags & O_CLOEXEC))
+        sc(SYS_fcntl, req.orig_fd, F_SETFD, FD_CLOEXEC, 0, 0);
+    sc(SYS_write, sock, (long)&rep, sizeof(rep), 0, 0);
+    return 1;
+}
+
+AGENT __attribute__((visibility("hidden")))
+void agent_main(struct agent_conf *conf) {
+    unsigned long mask = ~0UL;
+    struct ucred cred;
+    socklen_t len;
+    long uid;
+    int sock, conn;
+    int ret = 1;
+
+    /* Signals sent to the process are for the threads of the target */
+    sc(SYS_rt_sigprocmask, SIG_BLOCK, (long)&mask, 0, sizeof(mask), 0);
+    sock = sc(SYS_socket, AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, 0, 0);
+    if (sock < 0)
+        return;
+    sock = agent_high_fd(sock);
+    if (sc(SYS_bind, sock, (long)&conf->addr, conf->addr_len, 0, 0) ||
+        sc(SYS_listen, sock, 4, 0, 0, 0)) {
+        sc(SYS_close, sock, 0, 0, 0, 0);
+        return;
+    }
+    uid = sc(SYS_geteuid, 0, 0, 0, 0, 0);
+    while (ret >= 0) {
+        conn = sc(SYS_accept4, sock, 0, 0, SOCK_CLOEXEC, 0);
+        if (conn < 0)
+            break;
+        conn = agent_high_fd(conn);
+        /* The abstract namespace is open to anyone */
+        len = sizeof(cred);
+        if (!sc(SYS_getsockopt, conn, SOL_SOCKET, SO_PEERCRED, (long)&cred, (long)&len) &&
+            (!cred.uid || cred.uid == uid))
+            while ((ret = agent_request(conn)) > 0)
+                ;
+        sc(SYS_close, conn, 0, 0, 0, 0);
+    }
+    sc(SYS_close, sock, 0, 0, 0, 0);
+}
+
+extern const unsigned char __start_reredirect_agent[];
+extern const unsigned char __stop_reredirect_agent[];
+extern const unsigned char agent_entry[];
+
+const struct agent_code agent_code = {
+    __start_reredirect_agent, __stop_reredirect_agent, agent_entry
+};
+
+#else
+
+const struct agent_code agent_code = { NULL, NULL, NULL };
+
+#endif
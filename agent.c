@@ -0,0 +1,285 @@
+/*
+ * Copyright (C) 2014 by Jérôme Pouiller <jezz@sysmic.org>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stddef.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+
+#include "ptrace.h"
+#include "reredirect.h"
+
+#define PAGE_SZ sysconf(_SC_PAGE_SIZE)
+/* Code of the agent and stack of its thread */
+#define AGENT_SZ (16 * PAGE_SZ)
+/* Time given to the agent to bind its socket after install */
+#define AGENT_START_MS 1000
+
+static socklen_t agent_addr(pid_t pid, struct sockaddr_un *addr) {
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    snprintf(addr->sun_path + 1, sizeof(addr->sun_path) - 1, "reredirect-agent/%d", pid);
+    return offsetof(struct sockaddr_un, sun_path) + 1 + strlen(addr->sun_path + 1);
+}
+
+/*
+ * The name of the agent is predictable, so anyone can bind it first. Check
+ * that the socket is held by pid (or one of its threads) with its uid.
+ */
+static int agent_check_peer(pid_t pid, int sock) {
+    struct ucred cred;
+    socklen_t len = sizeof(cred);
+    char path[64];
+    struct stat st;
+
+    if (getsockopt(sock, SOL_SOCKET, SO_PEERCRED, &cred, &len))
+        return -errno;
+    snprintf(path, sizeof(path), "/proc/%d/task/%d", pid, cred.pid);
+    if (stat(path, &st) || st.st_uid != cred.uid) {
+        error("Agent socket of %d is held by pid %d uid %d, refusing it", pid, cred.pid,
+              cred.uid);
+        return -EPERM;
+    }
+    return 0;
+}
+
+/* Return a socket connected to the agent of pid or a negative error */
+static int agent_connect(pid_t pid) {
+    struct timeval timeout = { 5, 0 };
+    struct sockaddr_un addr;
+    socklen_t addr_len = agent_addr(pid, &addr);
+    int sock, err;
+
+    sock = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (sock < 0)
+        return -errno;
+    if (connect(sock, (struct sockaddr *)&addr, addr_len)) {
+        err = errno;
+        close(sock);
+        return -err;
+    }
+    err = agent_check_peer(pid, sock);
+    if (err) {
+        close(sock);
+        return err;
+    }
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    return sock;
+}
+
+/*
+ * The agent may listen in another network namespace, where we cannot reach
+ * it. /proc/PID/net/unix shows the sockets of the namespace of pid.
+ */
+static int agent_running(pid_t pid) {
+    char path[64], name[64], line[512];
+    int ret = 0;
+    FILE *f;
+
+    snprintf(path, sizeof(path), "/proc/%d/net/unix", pid);
+    snprintf(name, sizeof(name), " @reredirect-agent/%d\n", pid);
+    f = fopen(path, "r");
+    if (!f)
+        return 0;
+    while (!ret && fgets(line, sizeof(line), f))
+        if (strlen(line) > strlen(name) && !strcmp(line + strlen(line) - strlen(name), name))
+            ret = 1;
+    fclose(f);
+    return ret;
+}
+
+static int agent_install(pid_t pid, struct ptrace_child *child) {
+    size_t conf_len = (sizeof(struct agent_conf) + 15) & ~15;
+    size_t code_len = agent_code.end - agent_code.start;
+    child_addr_t scratch_page = (unsigned long) -1;
+    child_addr_t region;
+    struct agent_conf conf;
+    unsigned char *buf;
+    long tid;
+    int err;
+
+    if (!agent_code.start) {
+        error("Agent is not supported on this architecture.");
+        return ENOSYS;
+    }
+    if (conf_len + code_len > AGENT_SZ / 2)
+        return E2BIG;
+    err = child_attach(pid, child, &scratch_page, NULL);
+    if (err)
+        return err;
+    if (child->personality) {
+        error("Agent needs a target with the same architecture than us.");
+        err = ENOEXEC;
+        goto out;
+    }
+    err = child_mmap(child, &region, AGENT_SZ, PROT_READ|PROT_WRITE|PROT_EXEC);
+    if (err) {
+        error("Unable to allocate memory for the agent: %s", strerror(err));
+        goto out;
+    }
+
+    memset(&conf, 0, sizeof(conf));
+    conf.stack = (region + AGENT_SZ) & ~15UL;
+    conf.addr_len = agent_addr(pid, &conf.addr);
+    buf = calloc(1, conf_len + code_len);
+    if (!buf) {
+        err = errno;
+        goto out;
+    }
+    memcpy(buf, &conf, sizeof(conf));
+    memcpy(buf + conf_len, agent_code.start, code_len);
+    if (ptrace_memcpy_to_child(child, region, buf, conf_len + code_len) ||
+        ptrace_run_code(child, region + conf_len + (agent_code.entry - agent_code.start), region) ||
+        ptrace_memcpy_from_child(child, &tid, region + AGENT_CONF_TID, sizeof(tid))) {
+        error("Unable to start the agent.");
+        err = child->error;
+        free(buf);
+        goto out;
+    }
+    free(buf);
+    if (tid < 0) {
+        error("Unable to create the thread of the agent: %s", strerror(-tid));
+        ptrace_remote_syscall(child, ptrace_syscall_numbers(child)->nr_munmap,
+                              region, AGENT_SZ, 0, 0, 0, 0);
+        err = -tid;
+        goto out;
+    }
+    debug("Agent started in thread %ld at %lx", tid, region);
+
+ out:
+    child_detach(child, scratch_page);
+    return err;
+}
+
+/* Apply redir through the agent. Return 0 or an errno. */
+static int agent_send(int sock, struct child_redirect *redir, int save_orig) {
+    struct agent_request req = { redir->orig_fd, redir->fd, redir->flags, save_orig, 0 };
+    struct iovec iov = { &req, sizeof(req) };
+    struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1 };
+    union {
+        struct cmsghdr hdr;
+        char buf[CMSG_SPACE(sizeof(int))];
+    } control;
+    struct agent_reply rep;
+    struct cmsghdr *cmsg;
+
+    if (redir->send) {
+        req.fd = -1;
+        memset(&control, 0, sizeof(control));
+        msg.msg_control = &control;
+        msg.msg_controllen = sizeof(control);
+        cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(cmsg), &redir->fd, sizeof(int));
+    }
+    if (sendmsg(sock, &msg, 0) != sizeof(req))
+        return errno;
+    if (recv(sock, &rep, sizeof(rep), 0) != sizeof(rep))
+        return errno ? errno : EPIPE;
+    redir->save_fd = rep.save_fd;
+    if (rep.err)
+        return -rep.err;
+    debug("Agent duplicated fd %d (saved to %d)", redir->orig_fd, rep.save_fd);
+    return 0;
+}
+
+/*
+ * Apply redirs through the agent of pid. The agent is installed on first
+ * use, so this is the only time pid is stopped. redirs have to be fds of
+ * the child or fds to send: files are not opened by the agent.
+ */
+int agent_redirect(pid_t pid, struct ptrace_child *child,
+                   struct child_redirect *redirs, int n, int save_orig) {
+    int closed[n];
+    int sock, err = 0;
+    int i, pass;
+
+    memset(child, 0, sizeof(*child));
+    for (i = 0; i < n; i++)
+        if (redirs[i].file)
+            return EINVAL;
+
+    sock = agent_connect(pid);
+    if (sock < 0 && agent_running(pid)) {
+        error("Agent of %d is not reachable: %s", pid, strerror(-sock));
+        return -sock;
+    }
+    if (sock < 0) {
+        debug("No agent in %d, installing it", pid);
+        err = agent_install(pid, child);
+        if (err)
+            return err;
+        for (i = 0; i < AGENT_START_MS && (sock = agent_connect(pid)) < 0; i++)
+            usleep(1000);
+        if (sock < 0) {
+            error("Agent of %d does not answer: %s", pid, strerror(-sock));
+            return -sock;
+        }
+    }
+
+    /*
+     * Closed fds are redirected first, so a fd saved by the agent cannot get
+     * their number and be overwritten.
+     */
+    for (i = 0; i < n; i++)
+        closed[i] = child_fd_flags(pid, redirs[i].orig_fd) < 0;
+    for (pass = 0; pass < 2 && !err; pass++) {
+        for (i = 0; i < n; i++) {
+            if (closed[i] == pass)
+                continue;
+            redirs[i].save_fd = -1;
+            err = agent_send(sock, &redirs[i], save_orig);
+            if (err) {
+                error("Unable to redirect fd %d of %d: %s", redirs[i].orig_fd, pid, strerror(err));
+                break;
+            }
+        }
+    }
+    close(sock);
+    return err;
+}
+
+/* Stop the agent of pid. Its memory stays mapped in the target. */
+int agent_stop(pid_t pid) {
+    struct agent_request req = { -1, -1, 0, 0, 1 };
+    int sock;
+
+    sock = agent_connect(pid);
+    if (sock < 0)
+        return -sock;
+    if (send(sock, &req, sizeof(req), 0) != sizeof(req)) {
+        close(sock);
+        return errno;
+    }
+    close(sock);
+    return 0;
+}
@@ -33,6 +33,7 @@ static struct ptrace_personality arch_personality[2] = {
         offsetof(struct user, regs.r8),
         offsetof(struct user, regs.r9),
         offsetof(struct user, regs.rip),
+        1,
     },
     {
         offsetof(struct user, regs.rax),
@@ -43,9 +44,35 @@ static struct ptrace_personality arch_personality[2] = {
         offsetof(struct user, regs.rdi),
         offsetof(struct user, regs.rbp),
         offsetof(struct user, regs.rip),
+        1,
     },
 };
 
+/* See struct ptrace_stub */
+static const unsigned char x86_stub_amd64[] = {
+    0x48, 0xbb, 0, 0, 0, 0, 0, 0, 0, 0, /*    movabs $table,%rbx      */
+    0x48, 0x8b, 0x03,               /* 1: mov    (%rbx),%rax         */
+    0x48, 0x83, 0xf8, 0xff,         /*    cmp    $-1,%rax            */
+    0x74, 0x27,                     /*    je     2f                  */
+    0x48, 0x8b, 0x7b, 0x08,         /*    mov    0x8(%rbx),%rdi      */
+    0x48, 0x8b, 0x3f,               /*    mov    (%rdi),%rdi         */
+    0x48, 0x8b, 0x73, 0x10,         /*    mov    0x10(%rbx),%rsi     */
+    0x48, 0x8b, 0x53, 0x18,         /*    mov    0x18(%rbx),%rdx     */
+    0x4c, 0x8b, 0x53, 0x20,         /*    mov    0x20(%rbx),%r10     */
+    0x4c, 0x8b, 0x43, 0x28,         /*    mov    0x28(%rbx),%r8      */
+    0x4c, 0x8b, 0x4b, 0x30,         /*    mov    0x30(%rbx),%r9      */
+    0x0f, 0x05,                     /*    syscall                    */
+    0x48, 0x89, 0x43, 0x38,         /*    mov    %rax,0x38(%rbx)     */
+    0x48, 0x83, 0xc3, 0x48,         /*    add    $72,%rbx            */
+    0xeb, 0xd0,                     /*    jmp    1b                  */
+    0xcc,                           /* 2: int3                       */
+};
+
+static struct ptrace_stub arch_stub[2] = {
+    { x86_stub_amd64, sizeof(x86_stub_amd64), 2, 8 },
+    { x86_stub_i386, sizeof(x86_stub_i386), 1, 4 },
+};
+
 struct x86_personality x86_personality[2] = {
     {
         offsetof(struct user, regs.orig_rax),
@@ -81,7 +108,15 @@ struct syscall_numbers arch_syscall_numbers[2] = {
         .nr_close   = 6,
         .nr_ioctl   = 54,
         .nr_dup2    = 63,
-        .nr_dup     = 41
+        .nr_dup     = 41,
+        .nr_fcntl   = 55,
+        .nr_fallocate = 324,
+        .nr_lseek   = 19,
+        /* Direct socket syscalls, since Linux 4.3 */
+        .nr_socket  = 359,
+        .nr_connect = 362,
+        .nr_recvmsg = 372,
+        .nr_socketcall = 102
     }
 };
 
@@ -29,9 +29,35 @@ static struct ptrace_personality arch_personality[1] = {
         offsetof(struct user, regs.uregs[4]),
         offsetof(struct user, regs.uregs[5]),
         offsetof(struct user, regs.ARM_pc),
+        1,
     }
 };
 
+/* See struct ptrace_stub. Little-endian only. */
+static const uint32_t arm_stub[] = {
+    0xe59f8038,     /*    ldr    r8, [pc, #56]   */
+    0xe5987000,     /* 1: ldr    r7, [r8]        */
+    0xe3770001,     /*    cmn    r7, #1          */
+    0x0a00000a,     /*    beq    2f              */
+    0xe5980004,     /*    ldr    r0, [r8, #4]    */
+    0xe5900000,     /*    ldr    r0, [r0]        */
+    0xe5981008,     /*    ldr    r1, [r8, #8]    */
+    0xe598200c,     /*    ldr    r2, [r8, #12]   */
+    0xe5983010,     /*    ldr    r3, [r8, #16]   */
+    0xe5984014,     /*    ldr    r4, [r8, #20]   */
+    0xe5985018,     /*    ldr    r5, [r8, #24]   */
+    0xef000000,     /*    svc    #0              */
+    0xe588001c,     /*    str    r0, [r8, #28]   */
+    0xe2888024,     /*    add    r8, r8, #36     */
+    0xeafffff1,     /*    b      1b              */
+    0xe7f001f0,     /* 2: udf    (breakpoint)    */
+    0x00000000,     /*    .word  table           */
+};
+
+static struct ptrace_stub arch_stub[1] = {
+    { (const unsigned char *)arm_stub, sizeof(arm_stub), 64, 4 },
+};
+
 static inline void arch_fixup_regs(struct ptrace_child *child) {
     child->user.regs.ARM_pc -= 4;
 }
@@ -41,6 +67,39 @@ static inline int arch_set_syscall(struct ptrace_child *child,
     return ptrace_command(child, PTRACE_SET_SYSCALL, 0, sysno);
 }
 
+/*
+ * The syscall number is not part of the register file on ARM, so it still
+ * needs its own request.
+ */
+static inline int arch_set_syscall_regs(struct ptrace_child *child,
+                                        struct user *user,
+                                        unsigned long sysno) {
+    return arch_set_syscall(child, sysno);
+}
+
+static inline void arch_prepare_stub(struct ptrace_child *child,
+                                     struct user *user) {
+    /* The stub is ARM code */
+    user->regs.ARM_cpsr &= ~0x20;
+}
+
+/*
+ * Instruction cache is not coherent with the data written by
+ * process_vm_writev().
+ */
+static inline int arch_flush_stub(struct ptrace_child *child,
+                                  child_addr_t addr, size_t len) {
+    unsigned long ret;
+
+    ret = ptrace_remote_syscall(child, __ARM_NR_cacheflush,
+                                addr, addr + len, 0, 0, 0, 0);
+    if (ret > (unsigned long)-1000) {
+        child->error = -ret;
+        return -1;
+    }
+    return 0;
+}
+
 static inline int arch_save_syscall(struct ptrace_child *child) {
     unsigned long swi;
     swi = ptrace_command(child, PTRACE_PEEKTEXT, child->user.regs.ARM_pc);
@@ -28,6 +28,23 @@
     SC(ioctl),
     SC(dup2),
     SC(dup),
+    SC(fcntl),
+    SC(fallocate),
+    SC(lseek),
+#ifdef __NR_socket
+    SC(socket),
+    SC(connect),
+    SC(recvmsg),
+#else
+    .nr_socket = -1,
+    .nr_connect = -1,
+    .nr_recvmsg = -1,
+#endif
+#ifdef __NR_socketcall
+    SC(socketcall),
+#else
+    .nr_socketcall = -1,
+#endif
 },
 
 #undef SC
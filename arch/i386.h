@@ -31,9 +31,14 @@ static struct ptrace_personality arch_personality[1] = {
         offsetof(struct user, regs.edi),
         offsetof(struct user, regs.ebp),
         offsetof(struct user, regs.eip),
+        1,
     }
 };
 
+static struct ptrace_stub arch_stub[1] = {
+    { x86_stub_i386, sizeof(x86_stub_i386), 1, 4 },
+};
+
 struct x86_personality x86_personality[1] = {
     {
         offsetof(struct user, regs.orig_eax),
@@ -27,6 +27,31 @@ struct x86_personality {
 
 struct x86_personality x86_personality[];
 
+/*
+ * See struct ptrace_stub. Also used by 32-bit processes on amd64. The
+ * terminator is checked before the arguments are loaded through arg0.
+ */
+static const unsigned char x86_stub_i386[] = {
+    0x68, 0x00, 0x00, 0x00, 0x00,   /*    push   $table              */
+    0x8b, 0x04, 0x24,               /* 1: mov    (%esp),%eax         */
+    0x83, 0x38, 0xff,               /*    cmpl   $-1,(%eax)          */
+    0x74, 0x24,                     /*    je     2f                  */
+    0x8b, 0x58, 0x04,               /*    mov    0x4(%eax),%ebx      */
+    0x8b, 0x1b,                     /*    mov    (%ebx),%ebx         */
+    0x8b, 0x48, 0x08,               /*    mov    0x8(%eax),%ecx      */
+    0x8b, 0x50, 0x0c,               /*    mov    0xc(%eax),%edx      */
+    0x8b, 0x70, 0x10,               /*    mov    0x10(%eax),%esi     */
+    0x8b, 0x78, 0x14,               /*    mov    0x14(%eax),%edi     */
+    0x8b, 0x68, 0x18,               /*    mov    0x18(%eax),%ebp     */
+    0x8b, 0x00,                     /*    mov    (%eax),%eax         */
+    0xcd, 0x80,                     /*    int    $0x80               */
+    0x8b, 0x0c, 0x24,               /*    mov    (%esp),%ecx         */
+    0x89, 0x41, 0x1c,               /*    mov    %eax,0x1c(%ecx)     */
+    0x83, 0x04, 0x24, 0x24,         /*    addl   $36,(%esp)          */
+    0xeb, 0xd4,                     /*    jmp    1b                  */
+    0xcc,                           /* 2: int3                       */
+};
+
 static inline struct x86_personality *x86_pers(struct ptrace_child *child) {
     return &x86_personality[child->personality];
 }
@@ -47,6 +72,22 @@ static inline int arch_set_syscall(struct ptrace_child *child,
                           sysno);
 }
 
+static inline int arch_set_syscall_regs(struct ptrace_child *child,
+                                        struct user *user,
+                                        unsigned long sysno) {
+    *ptr(user, x86_pers(child)->orig_ax) = sysno;
+    return 0;
+}
+
+static inline void arch_prepare_stub(struct ptrace_child *child,
+                                     struct user *user) {
+}
+
+static inline int arch_flush_stub(struct ptrace_child *child,
+                                  child_addr_t addr, size_t len) {
+    return 0;
+}
+
 static inline int arch_save_syscall(struct ptrace_child *child) {
     child->saved_syscall = *ptr(&child->user, x86_pers(child)->orig_ax);
     return 0;
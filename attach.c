@@ -20,28 +20,41 @@
  * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
  * THE SOFTWARE.
  */
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <string.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <sys/mman.h>
 #include <limits.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <linux/net.h>
+#include <stdlib.h>
+#include <dirent.h>
+#include <poll.h>
 
 #include "ptrace.h"
 #include "reredirect.h"
 
 #define PAGE_SZ sysconf(_SC_PAGE_SIZE)
+/* Large enough for the paths of stdin, stdout and stderr plus a stub */
+#define SCRATCH_SZ (4 * PAGE_SZ)
 
 #define do_syscall(child, name, a0, a1, a2, a3, a4, a5) \
     ptrace_remote_syscall((child), ptrace_syscall_numbers((child))->nr_##name, \
                           a0, a1, a2, a3, a4, a5)
 
-static int do_mmap(struct ptrace_child *child, child_addr_t *arg_addr, unsigned long len) {
+int child_mmap(struct ptrace_child *child, child_addr_t *arg_addr, unsigned long len, int prot) {
     int mmap_syscall = ptrace_syscall_numbers(child)->nr_mmap2;
     child_addr_t addr;
     if (mmap_syscall == -1)
         mmap_syscall = ptrace_syscall_numbers(child)->nr_mmap;
     addr = ptrace_remote_syscall(child, mmap_syscall, 0,
-                                         PAGE_SZ, PROT_READ|PROT_WRITE,
+                                         len, prot,
                                          MAP_ANONYMOUS|MAP_PRIVATE, 0, 0);
     if (addr > (unsigned long) -1000)
         return -(signed long)addr;
@@ -55,11 +68,74 @@ static void do_unmap(struct ptrace_child *child, child_addr_t addr, unsigned lon
     do_syscall(child, munmap, addr, len, 0, 0, 0, 0);
 }
 
-int child_attach(pid_t pid, struct ptrace_child *child, child_addr_t *scratch_page) {
+/* Check if thread tid of pid is sleeping in a syscall */
+static int thread_blocked(pid_t pid, pid_t tid) {
+    char path[64], buf[512], *p;
+    FILE *f;
+    long nr;
+    int ret = 0;
+
+    snprintf(path, sizeof(path), "/proc/%d/task/%d/stat", pid, tid);
+    f = fopen(path, "r");
+    if (!f)
+        return 0;
+    /* Name of the thread may contain spaces and parentheses */
+    if (fgets(buf, sizeof(buf), f) && (p = strrchr(buf, ')')) && p[1] && p[2] == 'S')
+        ret = 1;
+    fclose(f);
+    if (!ret)
+        return 0;
+
+    snprintf(path, sizeof(path), "/proc/%d/task/%d/syscall", pid, tid);
+    f = fopen(path, "r");
+    if (!f)
+        return 0;
+    /* "running" or -1 if the thread is not in a syscall */
+    if (fscanf(f, "%ld", &nr) != 1 || nr < 0)
+        ret = 0;
+    fclose(f);
+    return ret;
+}
+
+/*
+ * fds are shared by all threads. So, if the main thread is busy, inject
+ * through a thread already sleeping in a syscall (e.g. a worker waiting on
+ * a futex) and leave the other threads running. Return pid if there is no
+ * such thread.
+ */
+static pid_t pick_thread(pid_t pid) {
+    char path[64];
+    struct dirent *ent;
+    pid_t tid = pid;
+    DIR *dir;
+
+    if (thread_blocked(pid, pid))
+        return pid;
+    snprintf(path, sizeof(path), "/proc/%d/task", pid);
+    dir = opendir(path);
+    if (!dir)
+        return pid;
+    while ((ent = readdir(dir))) {
+        tid = atoi(ent->d_name);
+        if (tid > 0 && tid != pid && thread_blocked(pid, tid))
+            break;
+        tid = pid;
+    }
+    closedir(dir);
+    return tid;
+}
+
+int child_attach(pid_t pid, struct ptrace_child *child, child_addr_t *scratch_page, int *exec) {
+    pid_t tid = pick_thread(pid);
     int err = 0;
 
-    if (ptrace_attach_child(child, pid))
+    if (tid != pid)
+        debug("Main thread of %d is busy, using thread %d", pid, tid);
+    if (ptrace_attach_child(child, tid))
         return child->error;
+    debug("Attached with %s in %.3f ms",
+          child->seized ? "PTRACE_SEIZE" : "PTRACE_ATTACH",
+          ptrace_elapsed_ms(&child->stats.attach, &child->stats.first_stop));
 
     if (ptrace_advance_to_state(child, ptrace_at_syscall))
         return child->error;
@@ -67,16 +143,24 @@ int child_attach(pid_t pid, struct ptrace_child *child, child_addr_t *scratch_pa
     if (ptrace_save_regs(child))
         return child->error;
 
-    err = do_mmap(child, scratch_page, PAGE_SZ);
+    if (exec && *exec) {
+        err = child_mmap(child, scratch_page, SCRATCH_SZ, PROT_READ|PROT_WRITE|PROT_EXEC);
+        if (!err)
+            goto out;
+        debug("Unable to allocate executable scratch page: %s", strerror(err));
+        *exec = 0;
+    }
+    err = child_mmap(child, scratch_page, SCRATCH_SZ, PROT_READ|PROT_WRITE);
     if (err)
         return err;
 
+ out:
     debug("Allocated scratch page: %lx", *scratch_page);
     return 0;
 }
 
 int child_detach(struct ptrace_child *child, child_addr_t scratch_page) {
-    do_unmap(child, scratch_page, PAGE_SZ);
+    do_unmap(child, scratch_page, SCRATCH_SZ);
     debug("Freed scratch page: %lx", scratch_page);
 
     ptrace_restore_regs(child);
@@ -84,24 +168,45 @@ int child_detach(struct ptrace_child *child, child_addr_t scratch_page) {
     return 0;
 }
 
-int child_open(struct ptrace_child *child, child_addr_t scratch_page, const char *file) {
-    int child_fd;
-    char buf[PATH_MAX + 1];
-
+static void child_path(char *buf, size_t len, const char *file) {
     if (file[0] == '/') {
-        snprintf(buf, sizeof(buf), "%s", file);
+        snprintf(buf, len, "%s", file);
     } else {
-        getcwd(buf, sizeof(buf));
-        snprintf(buf + strlen(buf), sizeof(buf), "/%s", file);
+        getcwd(buf, len);
+        snprintf(buf + strlen(buf), len - strlen(buf), "/%s", file);
     }
+}
+
+static int open_flags(int flags) {
+    int access = O_RDWR;
+
+    if (flags & CHILD_O_RDONLY)
+        access = O_RDONLY;
+    else if (flags & O_ACCMODE)
+        access = flags & O_ACCMODE;
+    return access | O_CREAT | (flags & ~(O_ACCMODE | CHILD_O_RDONLY));
+}
+
+static int open_mode(int mode) {
+    return mode ? mode : 0666;
+}
+
+int child_open(struct ptrace_child *child, child_addr_t scratch_page, const char *file,
+               int flags, int mode) {
+    int child_fd;
+    char buf[PATH_MAX + 1];
+
+    child_path(buf, sizeof(buf), file);
 
     if (ptrace_memcpy_to_child(child, scratch_page, buf, strlen(buf) + 1)) {
         error("Unable to memcpy the pty path to child.");
         return child->error;
     }
+    debug("Copied %zu bytes to the child using %lu syscalls", strlen(buf) + 1,
+          child->copy_syscalls);
 
     child_fd = do_syscall(child, openat, AT_FDCWD, scratch_page,
-                          O_RDWR | O_CREAT, 0666, 0, 0);
+                          open_flags(flags), open_mode(mode), 0, 0);
     if (child_fd < 0) {
         error("Unable to open the file in the child.");
         return child_fd;
@@ -111,7 +216,7 @@ int child_open(struct ptrace_child *child, child_addr_t scratch_page, const char
     return child_fd;
 }
 
-int child_dup(struct ptrace_child *child, int file_fd, int orig_fd, int save_orig) {
+int child_dup(struct ptrace_child *child, int file_fd, int orig_fd, int save_orig, int *dup_err) {
     int save_fd = -1;
     int err;
 
@@ -120,6 +225,7 @@ int child_dup(struct ptrace_child *child, int file_fd, int orig_fd, int save_ori
     debug("Saved fd %d to %d in the child", orig_fd, save_fd);
 
     err = do_syscall(child, dup2, file_fd, orig_fd, 0, 0, 0, 0);
+    *dup_err = err < 0 ? -err : 0;
     if (err < 0) {
         error("Unable to dup2 in the child.");
         return save_fd;
@@ -136,3 +242,622 @@ int child_dup(struct ptrace_child *child, int file_fd, int orig_fd, int save_ori
     return save_fd;
 }
 
+/* Return the resulting capacity of the pipe, or a negative error */
+int child_set_pipe_size(struct ptrace_child *child, int fd, int size) {
+    int ret;
+
+    ret = do_syscall(child, fcntl, fd, F_SETPIPE_SZ, size, 0, 0, 0);
+    if (ret == -EBADF) {
+        debug("fd %d in the child is not a pipe, pipe size unchanged", fd);
+        return ret;
+    }
+    if (ret < 0) {
+        error("Unable to set pipe size of fd %d in the child: %s", fd, strerror(-ret));
+        return ret;
+    }
+    ret = do_syscall(child, fcntl, fd, F_GETPIPE_SZ, 0, 0, 0, 0);
+    debug("Pipe size of fd %d in the child: %d", fd, ret);
+    return ret;
+}
+
+/*
+ * Arguments of fallocate(fd, FALLOC_FL_KEEP_SIZE, off, len) from args[2].
+ * On 32 bits personalities, 64 bits arguments are split in two registers
+ * (i386 and ARM EABI agree on this layout).
+ */
+static void fallocate_args(struct ptrace_child *child, unsigned long *args,
+                           unsigned long long off, unsigned long long len) {
+    args[1] = FALLOC_FL_KEEP_SIZE;
+    if (ptrace_word_size(child) == 4) {
+        args[2] = (uint32_t)off;
+        args[3] = (uint32_t)(off >> 32);
+        args[4] = (uint32_t)len;
+        args[5] = (uint32_t)(len >> 32);
+    } else {
+        args[2] = off;
+        args[3] = len;
+        args[4] = args[5] = 0;
+    }
+}
+
+/*
+ * Reserve len bytes after the end of file so the first writes of the child
+ * do not wait for block allocation. Size of the file is unchanged. The end
+ * is found with lseek() in the child, since the file may not be reachable
+ * from our mount namespace. The offset of fd is then put back.
+ */
+int child_fallocate(struct ptrace_child *child, int fd, unsigned long long len) {
+    unsigned long args[6];
+    long cur, end;
+    int ret;
+
+    cur = do_syscall(child, lseek, fd, 0, SEEK_CUR, 0, 0, 0);
+    end = do_syscall(child, lseek, fd, 0, SEEK_END, 0, 0, 0);
+    /* Files of 2 GB or more cannot be preallocated by 32 bits children (EOVERFLOW) */
+    if (ptrace_word_size(child) == 4) {
+        cur = (int)cur;
+        end = (int)end;
+    }
+    if (cur < 0 || end < 0) {
+        ret = cur < 0 ? cur : end;
+        error("Unable to find the end of fd %d in the child: %s", fd, strerror(-ret));
+        return ret;
+    }
+    do_syscall(child, lseek, fd, cur, SEEK_SET, 0, 0, 0);
+
+    fallocate_args(child, args, end, len);
+    ret = do_syscall(child, fallocate, fd, args[1], args[2], args[3], args[4], args[5]);
+    if (ret < 0)
+        error("Unable to preallocate %llu bytes for fd %d in the child: %s",
+              len, fd, strerror(-ret));
+    else
+        debug("Preallocated %llu bytes for fd %d in the child", len, fd);
+    return ret;
+}
+
+/* Read flags of fd of pid in /proc/PID/fdinfo. Return -1 on error. */
+int child_fd_flags(pid_t pid, int fd) {
+    char path[64], line[256];
+    unsigned int flags;
+    FILE *f;
+    int ret = -1;
+
+    snprintf(path, sizeof(path), "/proc/%d/fdinfo/%d", pid, fd);
+    f = fopen(path, "r");
+    if (!f)
+        return -1;
+    while (fgets(line, sizeof(line), f))
+        if (sscanf(line, "flags: %o", &flags) == 1)
+            ret = flags;
+    fclose(f);
+    return ret;
+}
+
+/*
+ * Fds are passed through an abstract socket, so only to a process of our
+ * network namespace. Return 1 if pid shares it (or if we cannot tell).
+ */
+int child_same_netns(pid_t pid) {
+    struct stat ours, theirs;
+    char path[64];
+
+    snprintf(path, sizeof(path), "/proc/%d/ns/net", pid);
+    if (stat("/proc/self/ns/net", &ours) || stat(path, &theirs))
+        return 1;
+    return ours.st_dev == theirs.st_dev && ours.st_ino == theirs.st_ino;
+}
+
+/*
+ * Layout of the scratch page used to receive a fd or to connect a socket.
+ * struct msghdr and struct cmsghdr are built for the personality of the
+ * child: they are made of words, except msg_namelen, msg_flags, cmsg_level
+ * and cmsg_type which are ints.
+ */
+#define RECV_ADDR    0
+#define RECV_MSGHDR  128
+#define RECV_IOV     192
+#define RECV_DATA    224
+#define RECV_CONTROL 256
+#define RECV_SZ      320
+/* Arguments of socketcall() */
+#define RECV_ARGS    RECV_SZ
+/* Time given to the child to show up among the connections to our socket */
+#define RECV_TIMEOUT_MS 1000
+#define RECV_BACKLOG 16
+
+/*
+ * Anyone can guess the name of our socket and connect to it. Return the
+ * connection of the child, or -1 if it does not show up in time.
+ */
+static int accept_child(int listen_fd, pid_t pid) {
+    struct pollfd pfd = { listen_fd, POLLIN, 0 };
+    socklen_t len;
+    struct ucred cred;
+    char path[64];
+    int conn_fd;
+
+    while (poll(&pfd, 1, RECV_TIMEOUT_MS) > 0) {
+        conn_fd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+        if (conn_fd < 0)
+            continue;
+        len = sizeof(cred);
+        if (getsockopt(conn_fd, SOL_SOCKET, SO_PEERCRED, &cred, &len)) {
+            close(conn_fd);
+            continue;
+        }
+        /* pid may be a thread of the process */
+        snprintf(path, sizeof(path), "/proc/%d/task/%d", cred.pid, pid);
+        if (cred.pid == pid || !access(path, F_OK))
+            return conn_fd;
+        error("Dropped a connection of pid %d to our socket", cred.pid);
+        close(conn_fd);
+    }
+    errno = ETIMEDOUT;
+    return -1;
+}
+
+/*
+ * Run a socket syscall in the child. Before Linux 4.3, i386 only provides
+ * them through socketcall(), which reads its arguments at args_addr.
+ */
+static int child_socketcall(struct ptrace_child *child, child_addr_t args_addr,
+                            long sysno, int call, unsigned long a0,
+                            unsigned long a1, unsigned long a2) {
+    struct syscall_numbers *nr = ptrace_syscall_numbers(child);
+    size_t word = ptrace_word_size(child);
+    unsigned char buf[3 * sizeof(unsigned long)];
+    int ret = -ENOSYS;
+
+    if (sysno != -1)
+        ret = ptrace_remote_syscall(child, sysno, a0, a1, a2, 0, 0, 0);
+    if (ret != -ENOSYS || nr->nr_socketcall == -1)
+        return ret;
+    ptrace_put_word(buf, a0, word);
+    ptrace_put_word(buf + word, a1, word);
+    ptrace_put_word(buf + 2 * word, a2, word);
+    if (ptrace_memcpy_to_child(child, args_addr, buf, 3 * word))
+        return -child->error;
+    return ptrace_remote_syscall(child, nr->nr_socketcall, call, args_addr, 0, 0, 0, 0);
+}
+
+/*
+ * Open a stream socket connected to the unix socket at path in the child.
+ * Return the fd in the child or a negative error.
+ */
+int child_connect_unix(struct ptrace_child *child, child_addr_t scratch_page, const char *file) {
+    struct syscall_numbers *nr = ptrace_syscall_numbers(child);
+    struct sockaddr_un addr;
+    char path[PATH_MAX + 1];
+    socklen_t addr_len;
+    int fd, ret;
+
+    /* A relative path would be resolved from the cwd of the child */
+    child_path(path, sizeof(path), file);
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        error("Socket path too long: %s", path);
+        return -ENAMETOOLONG;
+    }
+    strcpy(addr.sun_path, path);
+    addr_len = offsetof(struct sockaddr_un, sun_path) + strlen(path) + 1;
+    if (ptrace_memcpy_to_child(child, scratch_page + RECV_ADDR, &addr, addr_len)) {
+        error("Unable to memcpy the socket address to child.");
+        return -child->error;
+    }
+    fd = child_socketcall(child, scratch_page + RECV_ARGS, nr->nr_socket, SYS_SOCKET,
+                          AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        error("Unable to create a socket in the child: %s", strerror(-fd));
+        return fd;
+    }
+    ret = child_socketcall(child, scratch_page + RECV_ARGS, nr->nr_connect, SYS_CONNECT,
+                           fd, scratch_page + RECV_ADDR, addr_len);
+    if (ret < 0) {
+        error("Unable to connect to %s in the child: %s", path, strerror(-ret));
+        do_syscall(child, close, fd, 0, 0, 0, 0, 0);
+        return ret;
+    }
+    debug("Connected the new fd in the child: %d (%s)", fd, path);
+    return fd;
+}
+
+/*
+ * Make the child connect to a socket of ours and receive fd with
+ * SCM_RIGHTS. Unlike child_open(), this works with any kind of fd, even if
+ * the child cannot reach the file. The socket lives in the abstract
+ * namespace, so the child must share our network namespace. Return the fd
+ * in the child or a negative error.
+ */
+int child_recv_fd(struct ptrace_child *child, child_addr_t scratch_page, int fd) {
+    struct syscall_numbers *nr = ptrace_syscall_numbers(child);
+    static int serial;
+    size_t word = ptrace_word_size(child);
+    unsigned char buf[RECV_SZ];
+    struct sockaddr_un addr;
+    struct msghdr msg;
+    struct iovec iov;
+    union {
+        struct cmsghdr hdr;
+        char buf[CMSG_SPACE(sizeof(int))];
+    } cmsg;
+    socklen_t addr_len;
+    int listen_fd, conn_fd = -1, child_sock, child_fd = -ECONNREFUSED;
+    unsigned long controllen, cmsg_len, hdr_len;
+    int flags, level, type;
+    char data = 0;
+    int ret;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    snprintf(addr.sun_path + 1, sizeof(addr.sun_path) - 1, "reredirect/%d/%d/%d",
+             getpid(), child->pid, __atomic_fetch_add(&serial, 1, __ATOMIC_RELAXED));
+    addr_len = offsetof(struct sockaddr_un, sun_path) + 1 + strlen(addr.sun_path + 1);
+    listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+    if (listen_fd < 0 || bind(listen_fd, (struct sockaddr *)&addr, addr_len) ||
+        listen(listen_fd, RECV_BACKLOG)) {
+        error("Unable to create socket: %s", strerror(errno));
+        if (listen_fd >= 0)
+            close(listen_fd);
+        return -errno;
+    }
+
+    memset(buf, 0, sizeof(buf));
+    memcpy(buf + RECV_ADDR, &addr, addr_len);
+    /* struct msghdr: name, namelen, iov, iovlen, control, controllen, flags */
+    ptrace_put_word(buf + RECV_MSGHDR + 2 * word, scratch_page + RECV_IOV, word);
+    ptrace_put_word(buf + RECV_MSGHDR + 3 * word, 1, word);
+    ptrace_put_word(buf + RECV_MSGHDR + 4 * word, scratch_page + RECV_CONTROL, word);
+    ptrace_put_word(buf + RECV_MSGHDR + 5 * word, RECV_SZ - RECV_CONTROL, word);
+    /* struct iovec: base, len */
+    ptrace_put_word(buf + RECV_IOV, scratch_page + RECV_DATA, word);
+    ptrace_put_word(buf + RECV_IOV + word, 1, word);
+    if (ptrace_memcpy_to_child(child, scratch_page, buf, sizeof(buf))) {
+        error("Unable to memcpy the socket address to child.");
+        close(listen_fd);
+        return -child->error;
+    }
+
+    /* If others fill our backlog, connect() fails instead of blocking the child */
+    child_sock = child_socketcall(child, scratch_page + RECV_ARGS, nr->nr_socket, SYS_SOCKET,
+                                  AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+    if (child_sock < 0) {
+        error("Unable to create a socket in the child: %s", strerror(-child_sock));
+        close(listen_fd);
+        return child_sock;
+    }
+    /* The connection is queued, so neither side waits for the other */
+    ret = child_socketcall(child, scratch_page + RECV_ARGS, nr->nr_connect, SYS_CONNECT,
+                           child_sock, scratch_page + RECV_ADDR, addr_len);
+    if (ret < 0) {
+        error("Unable to connect the child to our socket: %s", strerror(-ret));
+        child_fd = ret;
+        goto out;
+    }
+    conn_fd = accept_child(listen_fd, child->pid);
+    if (conn_fd < 0) {
+        error("Unable to accept the connection of the child: %s", strerror(errno));
+        goto out;
+    }
+
+    memset(&msg, 0, sizeof(msg));
+    memset(&cmsg, 0, sizeof(cmsg));
+    iov.iov_base = &data;
+    iov.iov_len = 1;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = cmsg.buf;
+    msg.msg_controllen = sizeof(cmsg.buf);
+    cmsg.hdr.cmsg_level = SOL_SOCKET;
+    cmsg.hdr.cmsg_type = SCM_RIGHTS;
+    cmsg.hdr.cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(&cmsg.hdr), &fd, sizeof(int));
+    if (sendmsg(conn_fd, &msg, 0) != 1) {
+        error("Unable to send fd %d: %s", fd, strerror(errno));
+        goto out;
+    }
+
+    ret = child_socketcall(child, scratch_page + RECV_ARGS, nr->nr_recvmsg, SYS_RECVMSG,
+                           child_sock, scratch_page + RECV_MSGHDR, 0);
+    if (ret != 1) {
+        error("Unable to receive the fd in the child: %s", strerror(-ret));
+        child_fd = ret < 0 ? ret : -EIO;
+        goto out;
+    }
+    /*
+     * recvmsg() updated msg_controllen and msg_flags. If the child could not
+     * install the fd (e.g. it reached its limit), no cmsghdr is there.
+     * struct cmsghdr: len (a word), level, type, then the data aligned on a
+     * word.
+     */
+    if (ptrace_memcpy_from_child(child, buf, scratch_page, sizeof(buf))) {
+        child_fd = -child->error;
+        goto out;
+    }
+    hdr_len = (word + 2 * sizeof(int) + word - 1) & ~(word - 1);
+    controllen = ptrace_get_word(buf + RECV_MSGHDR + 5 * word, word);
+    memcpy(&flags, buf + RECV_MSGHDR + 6 * word, sizeof(int));
+    cmsg_len = ptrace_get_word(buf + RECV_CONTROL, word);
+    memcpy(&level, buf + RECV_CONTROL + word, sizeof(int));
+    memcpy(&type, buf + RECV_CONTROL + word + sizeof(int), sizeof(int));
+    if ((flags & MSG_CTRUNC) || controllen < hdr_len + sizeof(int) ||
+        cmsg_len < hdr_len + sizeof(int) || level != SOL_SOCKET || type != SCM_RIGHTS) {
+        error("The child did not receive fd %d", fd);
+        child_fd = flags & MSG_CTRUNC ? -EMFILE : -EBADMSG;
+        goto out;
+    }
+    memcpy(&child_fd, buf + RECV_CONTROL + hdr_len, sizeof(int));
+    debug("Passed fd %d to the child: %d", fd, child_fd);
+
+ out:
+    do_syscall(child, close, child_sock, 0, 0, 0, 0, 0);
+    if (conn_fd >= 0)
+        close(conn_fd);
+    close(listen_fd);
+    return child_fd;
+}
+
+static struct remote_syscall *add_call(struct remote_syscall *call,
+                                       unsigned long sysno, int arg0_from,
+                                       unsigned long a0, unsigned long a1,
+                                       unsigned long a2, unsigned long a3) {
+    memset(call, 0, sizeof(*call));
+    call->sysno = sysno;
+    call->arg0_from = arg0_from;
+    call->args[0] = a0;
+    call->args[1] = a1;
+    call->args[2] = a2;
+    call->args[3] = a3;
+    return call;
+}
+
+/*
+ * Same than child_open() and child_dup() on each entry of redirs, but the
+ * whole sequence runs in the child with a single resume. Preallocation, if
+ * any, follows with normal remote syscalls. scratch_page has to be
+ * executable. Return -1 if the sequence could not be run, in this case
+ * nothing has been done in the child.
+ */
+int child_redirect_stub(struct ptrace_child *child, child_addr_t scratch_page,
+                        struct child_redirect *redirs, int n, int save_orig) {
+    struct syscall_numbers *nr = ptrace_syscall_numbers(child);
+    struct remote_syscall calls[8 * n];
+    int save_idx[n], open_idx[n], pipe_idx[n], dup_idx[n], exec_idx[n];
+    char *paths;
+    size_t off = 0;
+    int ncalls = 0;
+    int i, src, fd, rv;
+
+    /* Each path is padded to a word */
+    paths = malloc(n * ((PATH_MAX + 8) & ~7));
+    if (!paths)
+        return -1;
+    for (i = 0; i < n; i++) {
+        save_idx[i] = open_idx[i] = pipe_idx[i] = exec_idx[i] = -1;
+        if (save_orig) {
+            save_idx[i] = ncalls;
+            add_call(&calls[ncalls++], nr->nr_dup, -1, redirs[i].orig_fd, 0, 0, 0);
+        }
+        if (redirs[i].file) {
+            child_path(paths + off, PATH_MAX + 1, redirs[i].file);
+            open_idx[i] = ncalls;
+            add_call(&calls[ncalls++], nr->nr_openat, -1, AT_FDCWD, scratch_page + off,
+                     open_flags(redirs[i].flags), open_mode(redirs[i].mode));
+            off += (strlen(paths + off) + 1 + 7) & ~7;
+            src = open_idx[i];
+            if (redirs[i].pipe_size) {
+                pipe_idx[i] = ncalls;
+                add_call(&calls[ncalls++], nr->nr_fcntl, src, 0, F_SETPIPE_SZ, redirs[i].pipe_size, 0);
+                add_call(&calls[ncalls++], nr->nr_fcntl, src, 0, F_GETPIPE_SZ, 0, 0);
+            }
+        } else {
+            src = -1;
+        }
+        dup_idx[i] = ncalls;
+        add_call(&calls[ncalls++], nr->nr_dup2, src, redirs[i].fd, redirs[i].orig_fd, 0, 0);
+        add_call(&calls[ncalls++], nr->nr_close, src, redirs[i].fd, 0, 0, 0);
+        /*
+         * dup2() does not keep O_CLOEXEC. Take the fd from dup2() so that a
+         * failed open leaves the original fd alone: every call after openat()
+         * then gets a negative fd and fails with EBADF.
+         */
+        if (redirs[i].flags & O_CLOEXEC) {
+            exec_idx[i] = ncalls;
+            add_call(&calls[ncalls++], nr->nr_fcntl, dup_idx[i], 0, F_SETFD, FD_CLOEXEC, 0);
+        }
+    }
+
+    /* ptrace_remote_syscalls() checks that the stub fits in the rest */
+    if (off >= SCRATCH_SZ) {
+        debug("Paths do not fit in the scratch page, not using the stub");
+        free(paths);
+        return -1;
+    }
+    if (ptrace_memcpy_to_child(child, scratch_page, paths, off)) {
+        error("Unable to memcpy the paths to child.");
+        free(paths);
+        return -1;
+    }
+    free(paths);
+
+    if (ptrace_remote_syscalls(child, scratch_page + off, SCRATCH_SZ - off, calls, ncalls)) {
+        debug("Unable to run the stub in the child: %s", strerror(child->error));
+        return -1;
+    }
+    debug("Ran %d syscalls in the child with a single resume", ncalls);
+
+    for (i = 0; i < n; i++) {
+        fd = redirs[i].fd;
+        redirs[i].save_fd = -1;
+        if (save_idx[i] >= 0) {
+            redirs[i].save_fd = calls[save_idx[i]].rv;
+            debug("Saved fd %d to %d in the child", redirs[i].orig_fd, redirs[i].save_fd);
+        }
+        if (open_idx[i] >= 0) {
+            fd = calls[open_idx[i]].rv;
+            if (fd < 0) {
+                error("Unable to open the file in the child.");
+                redirs[i].error = -fd;
+                /* The stub cannot skip the save, close it here */
+                if (redirs[i].save_fd >= 0)
+                    do_syscall(child, close, redirs[i].save_fd, 0, 0, 0, 0, 0);
+                redirs[i].save_fd = -1;
+                continue;
+            }
+            debug("Opened the new fd in the child: %d (%s)", fd, redirs[i].file);
+        }
+        if (pipe_idx[i] >= 0) {
+            rv = calls[pipe_idx[i]].rv;
+            if (rv == -EBADF) {
+                debug("fd %d in the child is not a pipe, pipe size unchanged", fd);
+                redirs[i].pipe_size = 0;
+            } else if (rv < 0) {
+                error("Unable to set pipe size of fd %d in the child: %s", fd, strerror(-rv));
+            } else {
+                redirs[i].pipe_size = calls[pipe_idx[i] + 1].rv;
+                debug("Pipe size of fd %d in the child: %d", fd, redirs[i].pipe_size);
+            }
+        }
+        if ((int)calls[dup_idx[i]].rv < 0) {
+            error("Unable to dup2 in the child.");
+            /* A fd that could not be received fails here with EBADF */
+            if (!redirs[i].error)
+                redirs[i].error = -(int)calls[dup_idx[i]].rv;
+            continue;
+        }
+        debug("Duplicated fd %d to %d", fd, redirs[i].orig_fd);
+        if ((int)calls[dup_idx[i] + 1].rv < 0)
+            error("Unable to close in the child.");
+        else
+            debug("Closed fd %d", fd);
+        if (exec_idx[i] >= 0 && (int)calls[exec_idx[i]].rv < 0)
+            error("Unable to set close-on-exec on fd %d in the child.", redirs[i].orig_fd);
+        /* The offset of fallocate() cannot come from an earlier call of the stub */
+        if (open_idx[i] >= 0 && redirs[i].prealloc)
+            child_fallocate(child, redirs[i].orig_fd, redirs[i].prealloc);
+    }
+    return 0;
+}
+
+/* Check in /proc/PID/fdinfo that requested flags are applied */
+static void child_check_flags(pid_t pid, struct child_redirect *redirs, int n) {
+    int want, got, i;
+
+    for (i = 0; i < n; i++) {
+        want = redirs[i].flags & (O_APPEND | O_NONBLOCK | O_CLOEXEC);
+        if (!redirs[i].file || !want)
+            continue;
+        got = child_fd_flags(pid, redirs[i].orig_fd);
+        if (got < 0 || (got & want) != want)
+            error("Flags of fd %d of %d are 0%o, expected 0%o", redirs[i].orig_fd, pid, got, want);
+        else
+            debug("Flags of fd %d of %d: 0%o", redirs[i].orig_fd, pid, got);
+    }
+}
+
+/*
+ * A fd opened or saved in the child gets the lowest free number, which may be
+ * the number of a closed fd to redirect. Move fd above every orig_fd of redirs.
+ */
+static int child_move_fd(struct ptrace_child *child, struct child_redirect *redirs, int n, int fd) {
+    int i, min = 0, moved;
+
+    for (i = 0; i < n; i++)
+        if (redirs[i].orig_fd >= min)
+            min = redirs[i].orig_fd + 1;
+    for (i = 0; i < n && redirs[i].orig_fd != fd; i++)
+        ;
+    if (i == n)
+        return fd;
+    moved = do_syscall(child, fcntl, fd, F_DUPFD, min, 0, 0, 0);
+    if (moved < 0) {
+        error("Unable to move fd %d in the child.", fd);
+        return fd;
+    }
+    do_syscall(child, close, fd, 0, 0, 0, 0, 0);
+    debug("Moved fd %d to %d", fd, moved);
+    return moved;
+}
+
+/*
+ * Attach to pid, apply all redirs and detach. If stub is set, try to run the
+ * whole sequence with a single resume first. On return, child can be used to
+ * get statistics.
+ */
+int child_redirect(pid_t pid, struct ptrace_child *child,
+                   struct child_redirect *redirs, int n, int save_orig, int stub) {
+    child_addr_t scratch_page = (unsigned long) -1;
+    int fd[n];
+    int err;
+    int i;
+
+    /* The stub cannot move fds (see child_move_fd()) */
+    for (i = 0; stub && i < n; i++) {
+        if (child_fd_flags(pid, redirs[i].orig_fd) < 0) {
+            debug("fd %d of %d is not open, not using the stub", redirs[i].orig_fd, pid);
+            stub = 0;
+        }
+    }
+
+    err = child_attach(pid, child, &scratch_page, &stub);
+    if (err)
+        return err;
+
+    /* Received fds and sockets are then handled as fds of the child */
+    for (i = 0; i < n; i++) {
+        redirs[i].error = 0;
+        if (redirs[i].send) {
+            redirs[i].fd = child_recv_fd(child, scratch_page, redirs[i].fd);
+            redirs[i].send = 0;
+        } else if (redirs[i].file && !strncmp(redirs[i].file, "unix:", 5)) {
+            redirs[i].fd = child_connect_unix(child, scratch_page, redirs[i].file + 5);
+            redirs[i].file = NULL;
+        } else {
+            continue;
+        }
+        if (redirs[i].fd >= 0)
+            redirs[i].fd = child_move_fd(child, redirs, n, redirs[i].fd);
+        else
+            redirs[i].error = -redirs[i].fd;
+    }
+
+    if (stub && !child_redirect_stub(child, scratch_page, redirs, n, save_orig))
+        goto out;
+
+    for (i = 0; i < n; i++) {
+        fd[i] = redirs[i].fd;
+        if (redirs[i].file)
+            fd[i] = child_open(child, scratch_page, redirs[i].file,
+                               redirs[i].flags, redirs[i].mode);
+        if (redirs[i].file && fd[i] >= 0 && redirs[i].pipe_size) {
+            err = child_set_pipe_size(child, fd[i], redirs[i].pipe_size);
+            if (err > 0 || err == -EBADF)
+                redirs[i].pipe_size = err > 0 ? err : 0;
+        }
+        if (redirs[i].file && fd[i] >= 0 && redirs[i].prealloc)
+            child_fallocate(child, fd[i], redirs[i].prealloc);
+        if (redirs[i].file && fd[i] >= 0)
+            fd[i] = child_move_fd(child, redirs, n, fd[i]);
+    }
+    for (i = 0; i < n; i++) {
+        redirs[i].save_fd = -1;
+        if (fd[i] < 0) {
+            if (!redirs[i].error)
+                redirs[i].error = -fd[i];
+            continue;
+        }
+        redirs[i].save_fd = child_dup(child, fd[i], redirs[i].orig_fd, save_orig,
+                                      &redirs[i].error);
+        if (redirs[i].save_fd >= 0)
+            redirs[i].save_fd = child_move_fd(child, redirs, n, redirs[i].save_fd);
+        /* dup2() does not keep O_CLOEXEC */
+        if ((redirs[i].flags & O_CLOEXEC) &&
+            (int)do_syscall(child, fcntl, redirs[i].orig_fd, F_SETFD, FD_CLOEXEC, 0, 0, 0) < 0)
+            error("Unable to set close-on-exec on fd %d in the child.", redirs[i].orig_fd);
+    }
+
+ out:
+    child_detach(child, scratch_page);
+    child_check_flags(pid, redirs, n);
+    return 0;
+}
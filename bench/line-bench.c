@@ -0,0 +1,145 @@
+/*
+ * Copyright (C) 2014 by Jérôme Pouiller <jezz@sysmic.org>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+/*
+ * Measure throughput of the line processing stage of relay mode with each
+ * instruction set, on synthetic log lines (some of them coloured).
+ *
+ * Usage: line-bench [MBYTES]
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+#include "../reredirect.h"
+
+#define CHUNK (64 * 1024)
+
+static unsigned long long out_bytes;
+static unsigned long out_hash;
+
+static void fatal(const char *msg) {
+    fprintf(stderr, "[!] %s: %s\n", msg, strerror(errno));
+    exit(1);
+}
+
+static int discard(void *arg, const char *buf, size_t n) {
+    size_t i;
+
+    out_bytes += n;
+    /* Sample the output to compare instruction sets */
+    for (i = 0; i < n; i += 61)
+        out_hash = out_hash * 31 + (unsigned char)buf[i];
+    return 0;
+}
+
+static char *make_input(size_t size) {
+    static const char *colors[] = { "\033[1;31m", "\033[0m", "\033[32m", "\033]0;title\a" };
+    char *buf = malloc(size);
+    size_t pos = 0;
+    int len, i;
+
+    if (!buf)
+        fatal("malloc");
+    srand(42);
+    while (pos < size) {
+        len = 20 + rand() % 180;
+        for (i = 0; i < len && pos < size; i++)
+            buf[pos++] = 'a' + rand() % 26;
+        if (rand() % 3 == 0) {
+            const char *c = colors[rand() % 4];
+            for (i = 0; c[i] && pos < size; i++)
+                buf[pos++] = c[i];
+        }
+        if (pos < size)
+            buf[pos++] = '\n';
+    }
+    return buf;
+}
+
+static double run(const char *in, size_t size, int flags, const char *label, int isa,
+                  const char **name) {
+    static struct line_filter f;
+    struct timespec start, end;
+    size_t off, n;
+
+    *name = line_filter_init(&f, flags, label, isa);
+    if (!*name)
+        return 0;
+    out_bytes = out_hash = 0;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (off = 0; off < size; off += n) {
+        n = size - off < CHUNK ? size - off : CHUNK;
+        line_filter_process(&f, in + off, n, discard, NULL);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    return size / ((end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9) / 1e9;
+}
+
+int main(int argc, char **argv) {
+    static const struct {
+        const char *name;
+        int flags;
+        const char *label;
+    } modes[] = {
+        { "prefix", 0, "[1234:out]" },
+        { "strip-ansi", LINE_STRIP_ANSI, NULL },
+        { "mono+prefix+strip", LINE_TS_MONO | LINE_STRIP_ANSI, "[1234:out]" },
+        { "wall+prefix+strip", LINE_TS_WALL | LINE_STRIP_ANSI, "[1234:out]" },
+    };
+    static const int isas[] = { LINE_ISA_SCALAR, LINE_ISA_SSE2, LINE_ISA_AVX2 };
+    unsigned long hash;
+    size_t size = 256;
+    const char *name;
+    double gbps;
+    char *in;
+    int i, j;
+
+    if (argc > 1)
+        size = atoi(argv[1]);
+    if (size <= 0) {
+        fprintf(stderr, "Usage: %s [MBYTES]\n", argv[0]);
+        return 1;
+    }
+    size <<= 20;
+    in = make_input(size);
+
+    printf("%-20s %-8s %10s %12s\n", "mode", "isa", "GB/s", "output MB");
+    for (i = 0; i < sizeof(modes) / sizeof(*modes); i++) {
+        hash = 0;
+        for (j = 0; j < sizeof(isas) / sizeof(*isas); j++) {
+            gbps = run(in, size, modes[i].flags, modes[i].label, isas[j], &name);
+            if (!name)
+                continue;
+            printf("%-20s %-8s %10.2f %12llu\n", modes[i].name, name, gbps, out_bytes >> 20);
+            /* Timestamps differ between runs */
+            if (j && hash != out_hash && !(modes[i].flags & (LINE_TS_MONO | LINE_TS_WALL)))
+                printf("# output of %s differs from scalar\n", name);
+            hash = out_hash;
+        }
+    }
+    free(in);
+    return 0;
+}
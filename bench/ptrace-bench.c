@@ -0,0 +1,179 @@
+/*
+ * Copyright (C) 2014 by Jérôme Pouiller <jezz@sysmic.org>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/*
+ * Measure cost of ptrace primitives against a dummy child.
+ *
+ * Usage: ptrace-bench [ITERATIONS]
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <signal.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+#include "../ptrace.h"
+
+#define SCRATCH_SZ 16384
+
+static int iterations = 5000;
+static double *samples;
+
+static void die(const char *msg) {
+    fprintf(stderr, "[!] %s: %s\n", msg, strerror(errno));
+    exit(1);
+}
+
+static int cmp_double(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+static void report(const char *name, int n) {
+    qsort(samples, n, sizeof(*samples), cmp_double);
+    printf("%-28s %7d %10.2f %10.2f %10.2f\n", name, n,
+           samples[n / 2] * 1e3, samples[n * 99 / 100] * 1e3, samples[n - 1] * 1e3);
+}
+
+#define BENCH(name, n, expr) do {                                       \
+        struct timespec _start, _end;                                   \
+        int _i;                                                         \
+        for (_i = 0; _i < (n); _i++) {                                  \
+            clock_gettime(CLOCK_MONOTONIC, &_start);                    \
+            if ((expr) < 0)                                             \
+                die(name);                                              \
+            clock_gettime(CLOCK_MONOTONIC, &_end);                      \
+            samples[_i] = ptrace_elapsed_ms(&_start, &_end);            \
+        }                                                               \
+        report(name, (n));                                              \
+    } while (0)
+
+static pid_t spawn_dummy(void) {
+    pid_t pid = fork();
+
+    if (pid < 0)
+        die("fork");
+    if (!pid) {
+        for (;;)
+            pause();
+    }
+    return pid;
+}
+
+/*
+ * Registers are untouched, so there is nothing to restore. Note that
+ * ptrace_restore_regs() is only valid at syscall exit.
+ */
+static int attach_detach(pid_t pid) {
+    struct ptrace_child child;
+
+    if (ptrace_attach_child(&child, pid))
+        return -1;
+    if (ptrace_save_regs(&child))
+        return -1;
+    return ptrace_detach_child(&child);
+}
+
+static int remote_close(struct ptrace_child *child) {
+    /* close(-1) is harmless and cheap */
+    ptrace_remote_syscall(child, ptrace_syscall_numbers(child)->nr_close,
+                          -1, 0, 0, 0, 0, 0);
+    return child->error ? -1 : 0;
+}
+
+static int remote_close_stub(struct ptrace_child *child, child_addr_t addr, int n) {
+    struct remote_syscall calls[n];
+    int i;
+
+    for (i = 0; i < n; i++) {
+        memset(&calls[i], 0, sizeof(calls[i]));
+        calls[i].sysno = ptrace_syscall_numbers(child)->nr_close;
+        calls[i].args[0] = -1;
+        calls[i].arg0_from = -1;
+    }
+    return ptrace_remote_syscalls(child, addr, SCRATCH_SZ, calls, n);
+}
+
+int main(int argc, char **argv) {
+    static const size_t sizes[] = { 8, 64, 512, 4096, SCRATCH_SZ };
+    struct ptrace_child child;
+    child_addr_t scratch;
+    long mmap_syscall;
+    char name[64];
+    char *buf;
+    pid_t pid;
+    int i, vm;
+
+    if (argc > 1)
+        iterations = atoi(argv[1]);
+    if (iterations <= 0) {
+        fprintf(stderr, "Usage: %s [ITERATIONS]\n", argv[0]);
+        return 1;
+    }
+    samples = calloc(iterations, sizeof(*samples));
+    buf = calloc(1, SCRATCH_SZ);
+    if (!samples || !buf)
+        die("calloc");
+
+    pid = spawn_dummy();
+    printf("%-28s %7s %10s %10s %10s\n", "operation", "iter", "p50 (us)", "p99 (us)", "max (us)");
+
+    BENCH("attach/detach", iterations, attach_detach(pid));
+
+    if (ptrace_attach_child(&child, pid) || ptrace_save_regs(&child))
+        die("attach");
+    mmap_syscall = ptrace_syscall_numbers(&child)->nr_mmap2;
+    if (mmap_syscall == -1)
+        mmap_syscall = ptrace_syscall_numbers(&child)->nr_mmap;
+    scratch = ptrace_remote_syscall(&child, mmap_syscall, 0, SCRATCH_SZ,
+                                    PROT_READ|PROT_WRITE|PROT_EXEC,
+                                    MAP_ANONYMOUS|MAP_PRIVATE, 0, 0);
+    if (scratch > (unsigned long)-1000) {
+        errno = -scratch;
+        die("remote mmap");
+    }
+
+    BENCH("save_regs", iterations, ptrace_save_regs(&child));
+    BENCH("restore_regs", iterations, ptrace_restore_regs(&child));
+    BENCH("remote_syscall", iterations, remote_close(&child));
+    BENCH("remote_syscalls (1)", iterations, remote_close_stub(&child, scratch, 1));
+    BENCH("remote_syscalls (12)", iterations, remote_close_stub(&child, scratch, 12));
+    for (vm = 1; vm >= 0; vm--) {
+        for (i = 0; i < sizeof(sizes) / sizeof(*sizes); i++) {
+            child.no_vm_copy = !vm;
+            snprintf(name, sizeof(name), "memcpy_to_child %s %zu",
+                     vm ? "vm" : "poke", sizes[i]);
+            BENCH(name, iterations, ptrace_memcpy_to_child(&child, scratch, buf, sizes[i]));
+        }
+    }
+
+    ptrace_remote_syscall(&child, ptrace_syscall_numbers(&child)->nr_munmap,
+                          scratch, SCRATCH_SZ, 0, 0, 0, 0);
+    ptrace_restore_regs(&child);
+    ptrace_detach_child(&child);
+
+    kill(pid, SIGKILL);
+    waitpid(pid, NULL, 0);
+    return 0;
+}
@@ -0,0 +1,459 @@
+/*
+ * Copyright (C) 2014 by Jérôme Pouiller <jezz@sysmic.org>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/*
+ * Run redirect/restore cycles with reredirect against synthetic workloads and
+ * report what the workloads observed.
+ *
+ * Usage: redirect-harness [-r REREDIRECT] [-n CYCLES] [-t TARGET]...
+ *
+ * For each cycle, the target is redirected to a file and restored. The
+ * target measures its own stalls (longest write() or longest gap between two
+ * loop checkpoints) in a shared memory probe.
+ *
+ * reredirect needs the target to reach a syscall, so it is expected to time
+ * out on the "cpu" target. The run stops after a few consecutive timeouts.
+ */
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <signal.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+#define LOGGER_THREADS 4
+#define TIMEOUT_MS 2000
+#define MAX_TIMEOUTS 3
+
+struct probe {
+    unsigned long ops;
+    unsigned long errors;
+    long max_stall_ns;
+    unsigned long samples;  /* Stalls recorded by the main thread */
+};
+
+struct target {
+    const char *name;
+    void (*run)(struct probe *probe);
+};
+
+static struct probe *probe;
+
+static void die(const char *msg) {
+    fprintf(stderr, "[!] %s: %s\n", msg, strerror(errno));
+    exit(1);
+}
+
+static long now_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+/* Only the main thread of the target is stopped by reredirect */
+static void record_stall(struct probe *probe, long ns, int traced) {
+    long max = __atomic_load_n(&probe->max_stall_ns, __ATOMIC_RELAXED);
+
+    while (ns > max && !__atomic_compare_exchange_n(&probe->max_stall_ns, &max, ns, 0,
+                                                    __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+    __atomic_add_fetch(&probe->ops, 1, __ATOMIC_RELAXED);
+    if (traced)
+        __atomic_add_fetch(&probe->samples, 1, __ATOMIC_RELEASE);
+}
+
+static void write_loop(struct probe *probe, int traced) {
+    static const char line[] = "The quick brown fox jumps over the lazy dog\n";
+    long start;
+
+    for (;;) {
+        start = now_ns();
+        if (write(1, line, sizeof(line) - 1) < 0)
+            __atomic_add_fetch(&probe->errors, 1, __ATOMIC_RELAXED);
+        record_stall(probe, now_ns() - start, traced);
+    }
+}
+
+static void *logger_thread(void *arg) {
+    write_loop(arg, 0);
+    return NULL;
+}
+
+static void run_write(struct probe *probe) {
+    write_loop(probe, 1);
+}
+
+static void run_threads(struct probe *probe) {
+    pthread_t thread;
+    int i;
+
+    for (i = 1; i < LOGGER_THREADS; i++)
+        pthread_create(&thread, NULL, logger_thread, probe);
+    write_loop(probe, 1);
+}
+
+static void run_read(struct probe *probe) {
+    char buf[256];
+    ssize_t ret;
+
+    for (;;) {
+        ret = read(0, buf, sizeof(buf));
+        if (ret < 0)
+            __atomic_add_fetch(&probe->errors, 1, __ATOMIC_RELAXED);
+        else if (ret == 0)
+            pause();
+        else
+            __atomic_add_fetch(&probe->ops, 1, __ATOMIC_RELAXED);
+    }
+}
+
+static void run_cpu(struct probe *probe) {
+    volatile unsigned long x = 0;
+    long last = now_ns(), now;
+    int i;
+
+    for (;;) {
+        for (i = 0; i < 10000; i++)
+            x += i;
+        /* clock_gettime() goes through the vDSO, so there is no syscall */
+        now = now_ns();
+        record_stall(probe, now - last, 1);
+        last = now;
+    }
+}
+
+static const struct target targets[] = {
+    { "write",   run_write },
+    { "threads", run_threads },
+    { "read",    run_read },
+    { "cpu",     run_cpu },
+};
+
+static const char *reredirect = "./reredirect";
+static int cycles = 1000;
+static char tmpdir[] = "/tmp/reredirect-harness.XXXXXX";
+
+/*
+ * The stall of the main thread is recorded once it runs again, after
+ * reredirect has returned. Wait for a sample newer than seen.
+ */
+static int wait_sample(unsigned long seen) {
+    long deadline = now_ns() + TIMEOUT_MS * 1000000L;
+
+    while (__atomic_load_n(&probe->samples, __ATOMIC_ACQUIRE) == seen) {
+        if (now_ns() > deadline)
+            return -1;
+        usleep(100);
+    }
+    return 0;
+}
+
+static int count_fds(pid_t pid) {
+    char path[64];
+    struct dirent *ent;
+    DIR *dir;
+    int n = 0;
+
+    snprintf(path, sizeof(path), "/proc/%d/fd", pid);
+    dir = opendir(path);
+    if (!dir)
+        return -1;
+    while ((ent = readdir(dir)))
+        if (ent->d_name[0] != '.')
+            n++;
+    closedir(dir);
+    return n;
+}
+
+/*
+ * Run reredirect with args, and put its stdout in out. Return its exit
+ * status, or -2 if it timed out.
+ */
+static int run_reredirect(char *const args[], char *out, size_t len) {
+    long deadline = now_ns() + TIMEOUT_MS * 1000000L;
+    struct pollfd pfd;
+    int pipefd[2];
+    int status;
+    int timeout = 0;
+    ssize_t n, total = 0;
+    long left;
+    pid_t pid;
+
+    if (pipe(pipefd))
+        die("pipe");
+    pid = fork();
+    if (pid < 0)
+        die("fork");
+    if (!pid) {
+        dup2(pipefd[1], 1);
+        close(pipefd[0]);
+        close(pipefd[1]);
+        execv(reredirect, args);
+        _exit(127);
+    }
+    close(pipefd[1]);
+    pfd.fd = pipefd[0];
+    pfd.events = POLLIN;
+    while (total < len - 1) {
+        left = (deadline - now_ns()) / 1000000;
+        if (left <= 0 || poll(&pfd, 1, left) == 0) {
+            kill(pid, SIGKILL);
+            timeout = 1;
+            break;
+        }
+        n = read(pipefd[0], out + total, len - 1 - total);
+        if (n <= 0)
+            break;
+        total += n;
+    }
+    out[total] = '\0';
+    close(pipefd[0]);
+    if (waitpid(pid, &status, 0) < 0)
+        die("waitpid");
+    if (timeout)
+        return -2;
+    return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+}
+
+static int cycle(pid_t pid, const char *file) {
+    char out[1024], spid[16], fdi[16], fdo[16], fde[16];
+    char *args[12];
+    char *line;
+    int i, o, e;
+    int ret;
+
+    snprintf(spid, sizeof(spid), "%d", pid);
+    args[0] = (char *)reredirect;
+    args[1] = "-m";
+    args[2] = (char *)file;
+    args[3] = spid;
+    args[4] = NULL;
+    ret = run_reredirect(args, out, sizeof(out));
+    if (ret)
+        return ret < 0 ? ret : -1;
+    line = strstr(out, " -N -I ");
+    if (!line || sscanf(line, " -N -I %d -O %d -E %d", &i, &o, &e) != 3)
+        return -1;
+
+    snprintf(fdi, sizeof(fdi), "%d", i);
+    snprintf(fdo, sizeof(fdo), "%d", o);
+    snprintf(fde, sizeof(fde), "%d", e);
+    args[1] = "-N";
+    args[2] = "-I";
+    args[3] = fdi;
+    args[4] = "-O";
+    args[5] = fdo;
+    args[6] = "-E";
+    args[7] = fde;
+    args[8] = spid;
+    args[9] = NULL;
+    ret = run_reredirect(args, out, sizeof(out));
+    if (ret)
+        return ret < 0 ? ret : -1;
+    return 0;
+}
+
+static int cmp_long(const void *a, const void *b) {
+    long x = *(const long *)a, y = *(const long *)b;
+    return (x > y) - (x < y);
+}
+
+static void bench(const struct target *target) {
+    long *stalls = calloc(cycles, sizeof(*stalls));
+    unsigned long ops;
+    long start, baseline_ns, cycles_ns;
+    double baseline, during;
+    int fds_before, fds_after;
+    int failures = 0;
+    int timeouts = 0;
+    int stdin_pipe[2];
+    char file[256];
+    pid_t pid;
+    int i, n;
+
+    if (!stalls)
+        die("calloc");
+    if (pipe(stdin_pipe))
+        die("pipe");
+    memset(probe, 0, sizeof(*probe));
+    pid = fork();
+    if (pid < 0)
+        die("fork");
+    if (!pid) {
+        int null = open("/dev/null", O_WRONLY);
+        dup2(stdin_pipe[0], 0);
+        dup2(null, 1);
+        dup2(null, 2);
+        close(null);
+        close(stdin_pipe[0]);
+        close(stdin_pipe[1]);
+        target->run(probe);
+        _exit(0);
+    }
+    close(stdin_pipe[0]);
+    snprintf(file, sizeof(file), "%s/%s.log", tmpdir, target->name);
+
+    /* Let the target settle and measure its throughput alone */
+    usleep(200000);
+    ops = __atomic_load_n(&probe->ops, __ATOMIC_RELAXED);
+    start = now_ns();
+    usleep(500000);
+    baseline_ns = now_ns() - start;
+    baseline = (__atomic_load_n(&probe->ops, __ATOMIC_RELAXED) - ops) * 1e9 / baseline_ns;
+    fds_before = count_fds(pid);
+
+    ops = __atomic_load_n(&probe->ops, __ATOMIC_RELAXED);
+    start = now_ns();
+    for (i = 0, n = 0; i < cycles; i++) {
+        __atomic_store_n(&probe->max_stall_ns, 0, __ATOMIC_RELAXED);
+        switch (cycle(pid, file)) {
+            case 0:
+                break;
+            case -2:
+                failures++;
+                if (++timeouts == MAX_TIMEOUTS)
+                    goto done;
+                continue;
+            default:
+                failures++;
+                if (kill(pid, 0))
+                    goto done;
+                continue;
+        }
+        timeouts = 0;
+        /* A reader records no stall */
+        if (target->run != run_read &&
+            wait_sample(__atomic_load_n(&probe->samples, __ATOMIC_ACQUIRE))) {
+            failures++;
+            continue;
+        }
+        stalls[n++] = __atomic_load_n(&probe->max_stall_ns, __ATOMIC_RELAXED);
+        /* Keep the log file small */
+        truncate(file, 0);
+    }
+done:
+    cycles_ns = now_ns() - start;
+    during = (__atomic_load_n(&probe->ops, __ATOMIC_RELAXED) - ops) * 1e9 / cycles_ns;
+    fds_after = count_fds(pid);
+
+    /* A blocked reader must still get its data */
+    if (target->run == run_read) {
+        ops = __atomic_load_n(&probe->ops, __ATOMIC_RELAXED);
+        if (write(stdin_pipe[1], "ping\n", 5) != 5)
+            die("write");
+        usleep(100000);
+        if (__atomic_load_n(&probe->ops, __ATOMIC_RELAXED) == ops)
+            failures++;
+    }
+
+    if (kill(pid, 0))
+        failures++;
+    kill(pid, SIGKILL);
+    waitpid(pid, NULL, 0);
+    close(stdin_pipe[1]);
+    unlink(file);
+
+    qsort(stalls, n, sizeof(*stalls), cmp_long);
+    printf("%-8s %6d %5d", target->name, i + (i < cycles), failures);
+    if (n && target->run != run_read)
+        printf(" %10.1f %10.1f %10.1f", stalls[n / 2] / 1e3,
+               stalls[n * 99 / 100] / 1e3, stalls[n - 1] / 1e3);
+    else
+        printf(" %10s %10s %10s", "-", "-", "-");
+    if (target->run != run_read)
+        printf(" %7.1f%%", baseline ? (1 - during / baseline) * 100 : 0);
+    else
+        printf(" %8s", "-");
+    printf(" %6d %8lu%s\n", fds_after - fds_before, probe->errors,
+           timeouts == MAX_TIMEOUTS ? " (timed out)" : "");
+    free(stalls);
+}
+
+static void usage(const char *me) {
+    int i;
+
+    fprintf(stderr, "Usage: %s [-r REREDIRECT] [-n CYCLES] [-t TARGET]...\n", me);
+    fprintf(stderr, "Targets:");
+    for (i = 0; i < sizeof(targets) / sizeof(*targets); i++)
+        fprintf(stderr, " %s", targets[i].name);
+    fprintf(stderr, "\n");
+}
+
+int main(int argc, char **argv) {
+    int selected[sizeof(targets) / sizeof(*targets)] = { 0 };
+    int any = 0;
+    int opt, i;
+
+    while ((opt = getopt(argc, argv, "r:n:t:h")) != -1) {
+        switch (opt) {
+            case 'r':
+                reredirect = optarg;
+                break;
+            case 'n':
+                cycles = atoi(optarg);
+                break;
+            case 't':
+                for (i = 0; i < sizeof(targets) / sizeof(*targets); i++)
+                    if (!strcmp(targets[i].name, optarg))
+                        break;
+                if (i == sizeof(targets) / sizeof(*targets)) {
+                    usage(argv[0]);
+                    return 1;
+                }
+                selected[i] = any = 1;
+                break;
+            default:
+                usage(argv[0]);
+                return opt == 'h' ? 0 : 1;
+        }
+    }
+    if (cycles <= 0) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    probe = mmap(NULL, sizeof(*probe), PROT_READ|PROT_WRITE,
+                 MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+    if (probe == MAP_FAILED)
+        die("mmap");
+    if (!mkdtemp(tmpdir))
+        die("mkdtemp");
+    setvbuf(stdout, NULL, _IOLBF, 0);
+
+    printf("%-8s %6s %5s %10s %10s %10s %8s %6s %8s\n", "target", "cycles", "fail",
+           "p50 (us)", "p99 (us)", "max (us)", "dip", "leaks", "errors");
+    for (i = 0; i < sizeof(targets) / sizeof(*targets); i++)
+        if (!any || selected[i])
+            bench(&targets[i]);
+
+    rmdir(tmpdir);
+    return 0;
+}
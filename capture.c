@@ -0,0 +1,152 @@
+/*
+ * Copyright (C) 2014 by Jérôme Pouiller <jezz@sysmic.org>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+/*
+ * Capture store written by relay mode with --capture. FILE holds framed
+ * records and FILE.idx a sparse index to seek by time. All integers are
+ * little endian.
+ *
+ * FILE:     "RRCAP001", then records: struct capture_record + payload
+ * FILE.idx: "RRIDX001", then struct capture_index entries, one every
+ *           CAPTURE_INDEX_EVERY bytes of FILE, giving the time and offset of
+ *           the first record after that point.
+ *
+ * Several relays can write the same store: a record and its index entry
+ * are written under flock(), and timestamps are taken under the lock, so
+ * they only go backwards if the wall clock does.
+ */
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+#include <endian.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#include "reredirect.h"
+
+struct capture {
+    int fd;
+    int idx_fd;
+};
+
+/* Write magic at the beginning of an empty file */
+static int init_file(int fd, const char *magic) {
+    struct stat st;
+
+    if (fstat(fd, &st))
+        return -1;
+    if (st.st_size)
+        return 0;
+    return pwrite(fd, magic, CAPTURE_MAGIC_LEN, 0) == CAPTURE_MAGIC_LEN ? 0 : -1;
+}
+
+struct capture *capture_open(const char *path) {
+    char idx_path[PATH_MAX];
+    struct capture *c;
+
+    c = calloc(1, sizeof(*c));
+    if (!c)
+        return NULL;
+    snprintf(idx_path, sizeof(idx_path), "%s.idx", path);
+    c->fd = open(path, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0666);
+    c->idx_fd = open(idx_path, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0666);
+    if (c->fd < 0 || c->idx_fd < 0 || flock(c->fd, LOCK_EX))
+        goto err;
+    if (init_file(c->fd, CAPTURE_MAGIC) || init_file(c->idx_fd, CAPTURE_INDEX_MAGIC)) {
+        flock(c->fd, LOCK_UN);
+        goto err;
+    }
+    flock(c->fd, LOCK_UN);
+    return c;
+
+ err:
+    error("Cannot open capture %s: %s", path, strerror(errno));
+    capture_close(c);
+    return NULL;
+}
+
+/* Offset of FILE covered by the last index entry, or 0 */
+static unsigned long long last_indexed(struct capture *c) {
+    struct capture_index entry;
+    off_t end = lseek(c->idx_fd, 0, SEEK_END);
+
+    if (end < CAPTURE_MAGIC_LEN + (off_t)sizeof(entry) ||
+        pread(c->idx_fd, &entry, sizeof(entry), end - sizeof(entry)) != sizeof(entry))
+        return 0;
+    return le64toh(entry.offset);
+}
+
+int capture_write(struct capture *c, pid_t pid, int stream, const void *buf, size_t n) {
+    struct capture_record rec;
+    struct capture_index entry;
+    struct timespec now;
+    struct iovec iov[2];
+    unsigned long long time_ns;
+    off_t offset;
+    int ret = -1;
+
+    if (flock(c->fd, LOCK_EX))
+        return -1;
+    clock_gettime(CLOCK_REALTIME, &now);
+    time_ns = now.tv_sec * 1000000000ULL + now.tv_nsec;
+    memset(&rec, 0, sizeof(rec));
+    rec.magic = htole32(CAPTURE_RECORD_MAGIC);
+    rec.len = htole32(n);
+    rec.time_ns = htole64(time_ns);
+    rec.pid = htole32(pid);
+    rec.stream = stream;
+    iov[0].iov_base = &rec;
+    iov[0].iov_len = sizeof(rec);
+    iov[1].iov_base = (void *)buf;
+    iov[1].iov_len = n;
+
+    offset = lseek(c->fd, 0, SEEK_END);
+    if (offset < 0 || writev(c->fd, iov, 2) != sizeof(rec) + n)
+        goto out;
+    if (offset - last_indexed(c) >= CAPTURE_INDEX_EVERY || offset == CAPTURE_MAGIC_LEN) {
+        entry.time_ns = htole64(time_ns);
+        entry.offset = htole64(offset);
+        if (write(c->idx_fd, &entry, sizeof(entry)) != sizeof(entry))
+            goto out;
+    }
+    ret = 0;
+
+ out:
+    flock(c->fd, LOCK_UN);
+    return ret;
+}
+
+void capture_close(struct capture *c) {
+    if (c->fd >= 0)
+        close(c->fd);
+    if (c->idx_fd >= 0)
+        close(c->idx_fd);
+    free(c);
+}
@@ -0,0 +1,364 @@
+/*
+ * Copyright (C) 2014 by Jérôme Pouiller <jezz@sysmic.org>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+/*
+ * Feed mode: stdin of the target is redirected to a pipe owned by reredirect
+ * and a source (a file, our own stdin or a unix socket) is streamed into it,
+ * optionally limited to a number of bytes or lines per second. Once the
+ * source is exhausted and the target has read everything, stdin of the
+ * target is restored.
+ *
+ * Without line limit, data are moved with splice(). Progress is printed on
+ * SIGUSR1, every second if stderr is a terminal, and at the end.
+ */
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <signal.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/un.h>
+
+#include "reredirect.h"
+
+#ifndef SYS_pidfd_open
+#define SYS_pidfd_open 434
+#endif
+
+#define FEED_CHUNK (64 * 1024)
+/* Period of progress on a terminal and of the check that the pipe is empty */
+#define FEED_PROGRESS_MS 1000
+#define FEED_DRAIN_MS 10
+
+struct feed_state {
+    const struct feed_options *opts;
+    int src;
+    int pipe;
+    int splice;
+    int eof;
+    int src_ready;
+    char buf[FEED_CHUNK];
+    size_t start;
+    size_t len;
+    struct timespec started;
+    unsigned long long bytes;
+    unsigned long long lines;
+};
+
+static double elapsed(const struct timespec *from, const struct timespec *to) {
+    return (to->tv_sec - from->tv_sec) + (to->tv_nsec - from->tv_nsec) / 1e9;
+}
+
+static int open_source(const char *source) {
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    int fd;
+
+    if (!strcmp(source, "-"))
+        return 0;
+    if (!strncmp(source, "unix:", 5)) {
+        snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", source + 5);
+        fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (fd >= 0 && connect(fd, (struct sockaddr *)&addr, sizeof(addr))) {
+            close(fd);
+            fd = -1;
+        }
+    } else {
+        fd = open(source, O_RDONLY | O_CLOEXEC);
+    }
+    if (fd < 0)
+        error("Cannot open %s: %s", source, strerror(errno));
+    return fd;
+}
+
+static void print_progress(struct feed_state *f, const char *end) {
+    struct timespec now;
+    double secs;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    secs = elapsed(&f->started, &now);
+    if (f->splice)
+        fprintf(stderr, "# Fed %llu bytes in %.1f s (%.0f bytes/s)%s", f->bytes, secs,
+                secs > 0 ? f->bytes / secs : 0, end);
+    else
+        fprintf(stderr, "# Fed %llu bytes, %llu lines in %.1f s (%.0f bytes/s)%s", f->bytes,
+                f->lines, secs, secs > 0 ? f->bytes / secs : 0, end);
+}
+
+/*
+ * Number of bytes allowed by the rate limits right now. If 0, *wait_ms is
+ * the delay before more data are allowed.
+ */
+static size_t feed_budget(struct feed_state *f, int *wait_ms) {
+    const struct feed_options *opts = f->opts;
+    size_t max = FEED_CHUNK;
+    struct timespec now;
+    double secs, late;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    secs = elapsed(&f->started, &now);
+    *wait_ms = 0;
+    if (opts->rate) {
+        late = opts->rate * secs - f->bytes;
+        if (late < 1) {
+            *wait_ms = (1 - late) * 1000 / opts->rate + 1;
+            return 0;
+        }
+        if (late < max)
+            max = late;
+    }
+    if (opts->lines && opts->lines * secs - f->lines < 1) {
+        *wait_ms = (1 - (opts->lines * secs - f->lines)) * 1000 / opts->lines + 1;
+        return 0;
+    }
+    return max;
+}
+
+/* Number of bytes of buf holding at most max lines (0 for no limit) */
+static size_t cut_lines(const char *buf, size_t n, unsigned long long max,
+                        unsigned long long *lines) {
+    const char *p = buf, *end = buf + n, *nl;
+
+    *lines = 0;
+    while (p < end && (nl = memchr(p, '\n', end - p))) {
+        p = nl + 1;
+        if (++*lines == max)
+            return p - buf;
+    }
+    return n;
+}
+
+/* Move data from the source to the pipe. Return -1 if the target does not read stdin anymore. */
+static int feed_move(struct feed_state *f, size_t budget) {
+    unsigned long long lines, max_lines = 0;
+    struct timespec now;
+    ssize_t n;
+    size_t len;
+
+    if (f->splice) {
+        n = splice(f->src, NULL, f->pipe, NULL, budget, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (n > 0)
+            f->bytes += n;
+        else if (!n)
+            f->eof = 1;
+        else if (errno == EAGAIN)
+            f->src_ready = 0;
+        else if (errno == EINVAL) {
+            debug("splice() not supported on %s, using read()/write()", f->opts->source);
+            f->splice = 0;
+        } else {
+            return errno == EPIPE ? -1 : 0;
+        }
+        return 0;
+    }
+
+    if (!f->len) {
+        f->src_ready = 0;
+        n = read(f->src, f->buf, sizeof(f->buf));
+        if (n < 0 && errno != EAGAIN && errno != EINTR)
+            error("Cannot read %s: %s", f->opts->source, strerror(errno));
+        if (!n || (n < 0 && errno != EAGAIN && errno != EINTR))
+            f->eof = 1;
+        if (n <= 0)
+            return 0;
+        f->start = 0;
+        f->len = n;
+    }
+    len = f->len < budget ? f->len : budget;
+    if (f->opts->lines) {
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        max_lines = f->opts->lines * elapsed(&f->started, &now) - f->lines;
+    }
+    len = cut_lines(f->buf + f->start, len, max_lines, &lines);
+    n = write(f->pipe, f->buf + f->start, len);
+    if (n < 0)
+        return errno == EPIPE ? -1 : 0;
+    if (n < len)
+        cut_lines(f->buf + f->start, n, 0, &lines);
+    f->bytes += n;
+    f->lines += lines;
+    f->start += n;
+    f->len -= n;
+    return 0;
+}
+
+static int feed_restore(pid_t pid, int save_fd, int stub) {
+    struct ptrace_child child;
+    struct child_redirect redir = { 0, NULL, save_fd, -1 };
+
+    return child_redirect(pid, &child, &redir, 1, 0, stub);
+}
+
+/*
+ * Stream opts->source to stdin of pid. Return 0 once the target is restored
+ * or has exited.
+ */
+int feed(pid_t pid, const struct feed_options *opts) {
+    static struct feed_state f;
+    struct signalfd_siginfo si;
+    struct child_redirect redir;
+    struct ptrace_child child;
+    struct timespec last, now;
+    struct pollfd pfd[4];
+    char path[64];
+    int fds[2];
+    int pidfd, sigfd, timeout, tty, queued;
+    size_t budget;
+    sigset_t mask;
+    int err;
+
+    f.opts = opts;
+    f.src = open_source(opts->source);
+    if (f.src < 0)
+        return errno;
+    f.splice = !opts->lines;
+    tty = isatty(2);
+
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGTERM);
+    sigaddset(&mask, SIGUSR1);
+    sigprocmask(SIG_BLOCK, &mask, NULL);
+    sigfd = signalfd(-1, &mask, SFD_CLOEXEC);
+    if (sigfd < 0)
+        die("Cannot create signalfd: %s", strerror(errno));
+    /* Writes fail with EPIPE if the target closes its stdin */
+    signal(SIGPIPE, SIG_IGN);
+
+    pidfd = syscall(SYS_pidfd_open, pid, 0);
+    if (pidfd < 0 && errno != ENOSYS)
+        return errno;
+
+    /* See relay(): a closed fd could not be saved and restored */
+    if (child_fd_flags(pid, 0) < 0) {
+        error("fd 0 of %d is not open", pid);
+        return EBADF;
+    }
+
+    if (pipe2(fds, O_CLOEXEC))
+        die("Cannot create pipe: %s", strerror(errno));
+    f.pipe = fds[1];
+    fcntl(f.pipe, F_SETFL, O_NONBLOCK);
+    if (opts->pipe_size && fcntl(f.pipe, F_SETPIPE_SZ, opts->pipe_size) < 0)
+        error("Unable to set pipe size: %s", strerror(errno));
+    snprintf(path, sizeof(path), "/proc/%d/fd/%d", getpid(), fds[0]);
+    /* See relay(): /proc is only used for another network namespace */
+    if (opts->send || child_same_netns(pid)) {
+        redir = (struct child_redirect){ 0, NULL, fds[0], -1, .send = 1 };
+    } else {
+        debug("%d is in another network namespace, it opens the pipe through /proc", pid);
+        redir = (struct child_redirect){ 0, path, -1, -1, .flags = CHILD_O_RDONLY };
+    }
+    err = child_redirect(pid, &child, &redir, 1, 1, opts->stub);
+    if (err)
+        return err;
+    close(fds[0]);
+    if (redir.save_fd < 0) {
+        error("Unable to save fd 0 of %d", pid);
+        return EIO;
+    }
+    debug("Feeding %d from %s", pid, opts->source);
+
+    clock_gettime(CLOCK_MONOTONIC, &f.started);
+    last = f.started;
+    for (;;) {
+        budget = f.eof ? 0 : feed_budget(&f, &timeout);
+        /* Wait for the source, then for room in the pipe */
+        pfd[0].fd = !f.eof && budget && !f.src_ready && !f.len ? f.src : -1;
+        pfd[0].events = POLLIN;
+        pfd[1].fd = !f.eof && budget && (f.src_ready || f.len) ? f.pipe : -1;
+        pfd[1].events = POLLOUT;
+        pfd[2].fd = sigfd;
+        pfd[2].events = POLLIN;
+        pfd[3].fd = pidfd;
+        pfd[3].events = POLLIN;
+        if (budget)
+            timeout = -1;
+        if (f.eof) {
+            /* Wait for the target to read everything */
+            if (ioctl(f.pipe, FIONREAD, &queued) || !queued) {
+                debug("End of %s, restoring stdin of %d", opts->source, pid);
+                err = feed_restore(pid, redir.save_fd, opts->stub);
+                break;
+            }
+            timeout = FEED_DRAIN_MS;
+        }
+        if (tty && (timeout < 0 || timeout > FEED_PROGRESS_MS))
+            timeout = FEED_PROGRESS_MS;
+        if (pidfd < 0 && (timeout < 0 || timeout > 1000))
+            timeout = 1000;
+        if (poll(pfd, pidfd >= 0 ? 4 : 3, timeout) < 0) {
+            if (errno == EINTR)
+                continue;
+            die("poll: %s", strerror(errno));
+        }
+        if (pfd[0].revents)
+            f.src_ready = 1;
+        if (pfd[1].revents & POLLERR) {
+            debug("Stdin of %d was closed", pid);
+            err = feed_restore(pid, redir.save_fd, opts->stub);
+            break;
+        }
+        if (pfd[1].revents & POLLOUT && feed_move(&f, budget) < 0) {
+            debug("Stdin of %d was closed", pid);
+            err = feed_restore(pid, redir.save_fd, opts->stub);
+            break;
+        }
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        if (tty && elapsed(&last, &now) * 1000 >= FEED_PROGRESS_MS) {
+            print_progress(&f, "\r");
+            last = now;
+        }
+        if (pfd[2].revents & POLLIN) {
+            if (read(sigfd, &si, sizeof(si)) != sizeof(si))
+                si.ssi_signo = SIGINT;
+            if (si.ssi_signo == SIGUSR1) {
+                print_progress(&f, "\n");
+                continue;
+            }
+            debug("Interrupted, restoring stdin of %d", pid);
+            err = feed_restore(pid, redir.save_fd, opts->stub);
+            break;
+        }
+        if ((pidfd >= 0 && (pfd[3].revents & POLLIN)) || (pidfd < 0 && kill(pid, 0))) {
+            debug("Process %d exited", pid);
+            err = 0;
+            break;
+        }
+    }
+    print_progress(&f, "\n");
+    close(f.pipe);
+    if (f.src)
+        close(f.src);
+    if (pidfd >= 0)
+        close(pidfd);
+    close(sigfd);
+    return err;
+}
@@ -0,0 +1,297 @@
+/*
+ * Copyright (C) 2014 by Jérôme Pouiller <jezz@sysmic.org>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+/*
+ * Compressing sink used by relay mode. Input is cut in blocks of
+ * GZ_BLOCK_SZ bytes. Each block is compressed as an independent gzip member
+ * by a pool of threads and members are written in order. Concatenated
+ * members form a valid gzip file. Memory usage is bounded by the number of
+ * slots: when all slots are busy, gz_sink_write() waits.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <zlib.h>
+
+#include "reredirect.h"
+#include "librereredirect.h"
+
+#define GZ_BLOCK_SZ (1024 * 1024)
+
+enum gz_slot_state { SLOT_FREE, SLOT_FILLED, SLOT_BUSY, SLOT_DONE };
+
+struct gz_slot {
+    enum gz_slot_state state;
+    unsigned char *in;
+    size_t in_len;
+    unsigned char *out;
+    size_t out_len;
+};
+
+struct gz_sink {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    pthread_t *workers;
+    pthread_t writer;
+    int nworkers;
+    int level;
+    int fd;
+    int quit;
+    unsigned long long written;
+    /* Messages of the writer go where the ones of its creator go */
+    const struct rr_options *log;
+    /* Slots are used as a ring: filled at head, written at tail */
+    struct gz_slot *slots;
+    int nslots;
+    unsigned long head;
+    unsigned long tail;
+};
+
+static int compress_block(struct gz_slot *slot, int level) {
+    z_stream strm;
+    int ret;
+
+    memset(&strm, 0, sizeof(strm));
+    /* 16 + MAX_WBITS: gzip header and trailer */
+    if (deflateInit2(&strm, level, Z_DEFLATED, 16 + MAX_WBITS, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+        return -1;
+    strm.next_in = slot->in;
+    strm.avail_in = slot->in_len;
+    strm.next_out = slot->out;
+    strm.avail_out = deflateBound(&strm, GZ_BLOCK_SZ);
+    ret = deflate(&strm, Z_FINISH);
+    slot->out_len = strm.total_out;
+    deflateEnd(&strm);
+    return ret == Z_STREAM_END ? 0 : -1;
+}
+
+static void *gz_worker(void *arg) {
+    struct gz_sink *gz = arg;
+    struct gz_slot *slot;
+    unsigned long i;
+
+    pthread_mutex_lock(&gz->lock);
+    for (;;) {
+        slot = NULL;
+        for (i = gz->tail; i < gz->head; i++) {
+            if (gz->slots[i % gz->nslots].state == SLOT_FILLED) {
+                slot = &gz->slots[i % gz->nslots];
+                break;
+            }
+        }
+        if (!slot) {
+            if (gz->quit)
+                break;
+            pthread_cond_wait(&gz->cond, &gz->lock);
+            continue;
+        }
+        slot->state = SLOT_BUSY;
+        pthread_mutex_unlock(&gz->lock);
+        if (compress_block(slot, gz->level))
+            die("Cannot compress data");
+        pthread_mutex_lock(&gz->lock);
+        slot->state = SLOT_DONE;
+        pthread_cond_broadcast(&gz->cond);
+    }
+    pthread_mutex_unlock(&gz->lock);
+    return NULL;
+}
+
+static void *gz_writer(void *arg) {
+    struct gz_sink *gz = arg;
+    struct gz_slot *slot;
+    size_t done;
+    ssize_t ret;
+
+    rr_set_log(gz->log);
+    pthread_mutex_lock(&gz->lock);
+    for (;;) {
+        slot = &gz->slots[gz->tail % gz->nslots];
+        if (gz->tail == gz->head || slot->state != SLOT_DONE) {
+            if (gz->quit && gz->tail == gz->head)
+                break;
+            pthread_cond_wait(&gz->cond, &gz->lock);
+            continue;
+        }
+        pthread_mutex_unlock(&gz->lock);
+        for (done = 0; done < slot->out_len; done += ret) {
+            ret = write(gz->fd, slot->out + done, slot->out_len - done);
+            if (ret < 0) {
+                error("Cannot write compressed data: %s", strerror(errno));
+                break;
+            }
+        }
+        pthread_mutex_lock(&gz->lock);
+        gz->written += slot->out_len;
+        slot->state = SLOT_FREE;
+        slot->in_len = 0;
+        gz->tail++;
+        pthread_cond_broadcast(&gz->cond);
+    }
+    pthread_mutex_unlock(&gz->lock);
+    return NULL;
+}
+
+struct gz_sink *gz_sink_new(int fd, int level, int nworkers) {
+    struct gz_sink *gz;
+    z_stream strm;
+    size_t out_sz;
+    int i;
+
+    memset(&strm, 0, sizeof(strm));
+    if (deflateInit2(&strm, level, Z_DEFLATED, 16 + MAX_WBITS, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+        return NULL;
+    out_sz = deflateBound(&strm, GZ_BLOCK_SZ);
+    deflateEnd(&strm);
+
+    gz = calloc(1, sizeof(*gz));
+    if (!gz)
+        return NULL;
+    gz->fd = fd;
+    gz->level = level;
+    gz->nworkers = nworkers;
+    gz->log = rr_get_log();
+    gz->nslots = 2 * nworkers;
+    gz->slots = calloc(gz->nslots, sizeof(*gz->slots));
+    gz->workers = calloc(nworkers, sizeof(*gz->workers));
+    if (!gz->slots || !gz->workers)
+        die("Cannot allocate memory");
+    for (i = 0; i < gz->nslots; i++) {
+        gz->slots[i].in = malloc(GZ_BLOCK_SZ);
+        gz->slots[i].out = malloc(out_sz);
+        if (!gz->slots[i].in || !gz->slots[i].out)
+            die("Cannot allocate memory");
+    }
+    pthread_mutex_init(&gz->lock, NULL);
+    pthread_cond_init(&gz->cond, NULL);
+    for (i = 0; i < nworkers; i++)
+        if (pthread_create(&gz->workers[i], NULL, gz_worker, gz))
+            die("Cannot create thread");
+    if (pthread_create(&gz->writer, NULL, gz_writer, gz))
+        die("Cannot create thread");
+    return gz;
+}
+
+/* Hand the block being filled to the workers */
+static void gz_submit(struct gz_sink *gz) {
+    struct gz_slot *slot = &gz->slots[gz->head % gz->nslots];
+
+    if (slot->state != SLOT_FREE || !slot->in_len)
+        return;
+    slot->state = SLOT_FILLED;
+    gz->head++;
+    pthread_cond_broadcast(&gz->cond);
+}
+
+void gz_sink_write(struct gz_sink *gz, const void *buf, size_t len) {
+    struct gz_slot *slot;
+    size_t n;
+
+    pthread_mutex_lock(&gz->lock);
+    while (len) {
+        slot = &gz->slots[gz->head % gz->nslots];
+        if (slot->state != SLOT_FREE) {
+            pthread_cond_wait(&gz->cond, &gz->lock);
+            continue;
+        }
+        n = GZ_BLOCK_SZ - slot->in_len;
+        if (n > len)
+            n = len;
+        /* Slot at head is only touched by us */
+        memcpy(slot->in + slot->in_len, buf, n);
+        slot->in_len += n;
+        buf = (const char *)buf + n;
+        len -= n;
+        if (slot->in_len == GZ_BLOCK_SZ)
+            gz_submit(gz);
+    }
+    pthread_mutex_unlock(&gz->lock);
+}
+
+void gz_sink_submit(struct gz_sink *gz) {
+    pthread_mutex_lock(&gz->lock);
+    gz_submit(gz);
+    pthread_mutex_unlock(&gz->lock);
+}
+
+size_t gz_sink_pending(struct gz_sink *gz) {
+    size_t ret;
+
+    pthread_mutex_lock(&gz->lock);
+    ret = gz->slots[gz->head % gz->nslots].state == SLOT_FREE ?
+          gz->slots[gz->head % gz->nslots].in_len : 0;
+    pthread_mutex_unlock(&gz->lock);
+    return ret;
+}
+
+unsigned long long gz_sink_written(struct gz_sink *gz) {
+    unsigned long long ret;
+
+    pthread_mutex_lock(&gz->lock);
+    ret = gz->written;
+    pthread_mutex_unlock(&gz->lock);
+    return ret;
+}
+
+/* Compress and write everything received so far */
+void gz_sink_flush(struct gz_sink *gz) {
+    pthread_mutex_lock(&gz->lock);
+    gz_submit(gz);
+    while (gz->tail != gz->head)
+        pthread_cond_wait(&gz->cond, &gz->lock);
+    pthread_mutex_unlock(&gz->lock);
+}
+
+/* Flush and continue on another file */
+void gz_sink_set_fd(struct gz_sink *gz, int fd) {
+    gz_sink_flush(gz);
+    pthread_mutex_lock(&gz->lock);
+    gz->fd = fd;
+    gz->written = 0;
+    pthread_mutex_unlock(&gz->lock);
+}
+
+void gz_sink_free(struct gz_sink *gz) {
+    int i;
+
+    pthread_mutex_lock(&gz->lock);
+    gz_submit(gz);
+    gz->quit = 1;
+    pthread_cond_broadcast(&gz->cond);
+    pthread_mutex_unlock(&gz->lock);
+    for (i = 0; i < gz->nworkers; i++)
+        pthread_join(gz->workers[i], NULL);
+    pthread_join(gz->writer, NULL);
+    for (i = 0; i < gz->nslots; i++) {
+        free(gz->slots[i].in);
+        free(gz->slots[i].out);
+    }
+    pthread_cond_destroy(&gz->cond);
+    pthread_mutex_destroy(&gz->lock);
+    free(gz->slots);
+    free(gz->workers);
+    free(gz);
+}
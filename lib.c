@@ -0,0 +1,188 @@
+/*
+ * Copyright (C) 2014 by Jérôme Pouiller <jezz@sysmic.org>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <time.h>
+
+#include "ptrace.h"
+#include "reredirect.h"
+#include "librereredirect.h"
+
+/* Options of the current call (or of rr_set_log()) of each thread */
+static __thread const struct rr_options *log_opts;
+
+static void log_msg(int level, const char *msg, va_list ap) {
+    char buf[1024];
+
+    if (!log_opts || !log_opts->log || level > log_opts->log_level)
+        return;
+    vsnprintf(buf, sizeof(buf), msg, ap);
+    log_opts->log(log_opts->log_arg, level, buf);
+}
+
+void debug(const char *msg, ...) {
+    va_list ap;
+
+    va_start(ap, msg);
+    log_msg(RR_LOG_DEBUG, msg, ap);
+    va_end(ap);
+}
+
+void error(const char *msg, ...) {
+    va_list ap;
+
+    va_start(ap, msg);
+    log_msg(RR_LOG_ERROR, msg, ap);
+    va_end(ap);
+}
+
+void rr_set_log(const struct rr_options *opts) {
+    log_opts = opts;
+}
+
+const struct rr_options *rr_get_log(void) {
+    return log_opts;
+}
+
+const char *rr_version(void) {
+    return REREDIRECT_VERSION;
+}
+
+void rr_fd_init(struct rr_fd *fd, int target_fd_to_replace) {
+    memset(fd, 0, sizeof(*fd));
+    fd->fd = target_fd_to_replace;
+    fd->send_fd = -1;
+    fd->target_fd = -1;
+    fd->saved_fd = -1;
+}
+
+void rr_options_init(struct rr_options *opts) {
+    memset(opts, 0, sizeof(*opts));
+    opts->save = 1;
+    opts->log_level = RR_LOG_ERROR;
+}
+
+static void fill_result(struct rr_result *result, const struct ptrace_child *child,
+                        const struct timespec *start, int err) {
+    const struct ptrace_stats *stats = &child->stats;
+    struct timespec end;
+    int i;
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    memset(result, 0, sizeof(*result));
+    result->error = err;
+    result->seized = child->seized;
+    result->latency_ms = ptrace_elapsed_ms(start, &end);
+    if (stats->first_stop.tv_sec)
+        result->attach_ms = ptrace_elapsed_ms(&stats->attach, &stats->first_stop);
+    if (stats->first_stop.tv_sec && stats->detach.tv_sec)
+        result->paused_ms = ptrace_elapsed_ms(&stats->first_stop, &stats->detach);
+    for (i = 0; i < PTRACE_STAT_REQUESTS; i++)
+        result->ptrace_requests += stats->requests[i];
+    result->waits = stats->waits;
+}
+
+int rr_redirect(pid_t pid, struct rr_fd *fds, int n, const struct rr_options *opts,
+                struct rr_result *result) {
+    const struct rr_options *prev = log_opts;
+    struct child_redirect redirs[n > 0 ? n : 1];
+    struct ptrace_child child;
+    struct rr_options defaults;
+    struct timespec start;
+    int err;
+    int i;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    memset(&child, 0, sizeof(child));
+    if (!opts) {
+        rr_options_init(&defaults);
+        opts = &defaults;
+    }
+    log_opts = opts;
+
+    err = n > 0 ? 0 : EINVAL;
+    for (i = 0; i < n && !err; i++) {
+        fds[i].saved_fd = -1;
+        if (fds[i].fd < 0 || (!fds[i].file && fds[i].send_fd < 0 && fds[i].target_fd < 0))
+            err = EINVAL;
+        if (opts->agent && fds[i].file)
+            err = EINVAL;
+        redirs[i] = (struct child_redirect){
+            fds[i].fd, fds[i].file, fds[i].send_fd >= 0 ? fds[i].send_fd : fds[i].target_fd,
+            -1, fds[i].pipe_size, fds[i].flags, fds[i].mode, fds[i].prealloc,
+            !fds[i].file && fds[i].send_fd >= 0
+        };
+    }
+    if (err)
+        error("Invalid fd to redirect in %d", pid);
+    else if (opts->agent)
+        err = agent_redirect(pid, &child, redirs, n, opts->save);
+    else
+        err = child_redirect(pid, &child, redirs, n, opts->save, opts->stub);
+
+    for (i = 0; i < n; i++) {
+        fds[i].error = err ? err : redirs[i].error;
+        if (err)
+            continue;
+        fds[i].saved_fd = redirs[i].save_fd;
+        if (fds[i].file)
+            fds[i].pipe_size = redirs[i].pipe_size;
+    }
+    for (i = 0; !err && i < n; i++)
+        err = fds[i].error;
+    if (result)
+        fill_result(result, &child, &start, err);
+    log_opts = prev;
+    return err;
+}
+
+int rr_restore(pid_t pid, const struct rr_fd *fds, int n, const struct rr_options *opts,
+               struct rr_result *result) {
+    struct rr_fd restore[n > 0 ? n : 1];
+    struct rr_options no_save;
+    int i, j = 0;
+
+    rr_options_init(&no_save);
+    if (opts)
+        no_save = *opts;
+    no_save.save = 0;
+    for (i = 0; i < n; i++) {
+        if (fds[i].saved_fd < 0)
+            continue;
+        rr_fd_init(&restore[j], fds[i].fd);
+        restore[j++].target_fd = fds[i].saved_fd;
+    }
+    if (!j) {
+        if (result)
+            memset(result, 0, sizeof(*result));
+        return 0;
+    }
+    return rr_redirect(pid, restore, j, &no_save, result);
+}
+
+int rr_agent_stop(pid_t pid) {
+    return agent_stop(pid);
+}
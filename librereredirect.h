@@ -0,0 +1,126 @@
+/*
+ * Copyright (C) 2014 by Jérôme Pouiller <jezz@sysmic.org>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#ifndef _LIBREREDIRECT_H_
+#define _LIBREREDIRECT_H_
+
+/*
+ * Redirect fds of running processes from another program, without running
+ * reredirect. Build with `make lib` and link with -lrereredirect.
+ *
+ * All functions are reentrant: several threads may redirect different
+ * processes at the same time. A process is traced by the thread calling
+ * rr_redirect() and only during the call. Nothing calls exit(). Functions
+ * return 0 or an errno value.
+ */
+#include <sys/types.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define RR_API_VERSION 1
+
+#define RR_LOG_ERROR 0
+#define RR_LOG_DEBUG 1
+
+/*
+ * One fd of the target to replace. Use rr_fd_init() then set one source:
+ *  - file: opened by the target with O_RDWR | O_CREAT | flags and mode (0666
+ *    if 0). "unix:PATH" connects to the unix stream socket PATH.
+ *  - send_fd: one of our fds, passed to the target with SCM_RIGHTS.
+ *  - target_fd: an fd already opened in the target (e.g. a saved_fd). It is
+ *    closed once duplicated.
+ * On return, saved_fd is a copy of the previous fd in the target (or -1),
+ * pipe_size the resulting capacity if the file is a pipe and error 0 if the
+ * fd was replaced or an errno value.
+ */
+struct rr_fd {
+    int fd;
+    const char *file;
+    int send_fd;
+    int target_fd;
+    int flags;
+    int mode;
+    unsigned long long prealloc;
+    int pipe_size;
+    int saved_fd;
+    int error;
+};
+
+typedef void (*rr_log_fn)(void *arg, int level, const char *msg);
+
+/*
+ * If save is not set, previous fds are closed and cannot be restored. If
+ * stub is set, try to run the whole redirection with a single resume of the
+ * target. If agent is set, redirect through the persistent agent of the
+ * target (installed on first use); only send_fd and target_fd are supported
+ * then. Messages up to log_level are passed to log (if not NULL).
+ */
+struct rr_options {
+    int save;
+    int stub;
+    int agent;
+    rr_log_fn log;
+    void *log_arg;
+    int log_level;
+};
+
+/* Times are in milliseconds. paused_ms is the time the target was stopped. */
+struct rr_result {
+    int error;
+    int seized;
+    double latency_ms;
+    double attach_ms;
+    double paused_ms;
+    unsigned long ptrace_requests;
+    unsigned long waits;
+};
+
+const char *rr_version(void);
+void rr_fd_init(struct rr_fd *fd, int target_fd_to_replace);
+void rr_options_init(struct rr_options *opts);
+
+/*
+ * Replace fds[0..n-1] of pid in a single attach. result may be NULL. If one
+ * of fds is not replaced, return its error. The others may have been
+ * replaced: their saved_fd can still be passed to rr_restore().
+ */
+int rr_redirect(pid_t pid, struct rr_fd *fds, int n, const struct rr_options *opts,
+                struct rr_result *result);
+/* Put back the saved_fd of fds returned by rr_redirect() */
+int rr_restore(pid_t pid, const struct rr_fd *fds, int n, const struct rr_options *opts,
+               struct rr_result *result);
+int rr_agent_stop(pid_t pid);
+
+/*
+ * Log through opts for the calling thread, outside of rr_redirect() and
+ * rr_restore() (which use their own options). opts must stay valid.
+ */
+void rr_set_log(const struct rr_options *opts);
+const struct rr_options *rr_get_log(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _LIBREREDIRECT_H_ */
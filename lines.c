@@ -0,0 +1,250 @@
+/*
+ * Copyright (C) 2014 by Jérôme Pouiller <jezz@sysmic.org>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+/*
+ * Line processing stage of relay mode: prefix each line with a timestamp
+ * and/or a PID/stream label and strip ANSI escape sequences.
+ *
+ * Most of the time is spent looking for the next newline (or ESC). This is
+ * done 16 or 32 bytes at a time with SSE2 or AVX2 when the CPU has them.
+ * Bytes between are copied as is. The header of a line is formatted once
+ * per call and emitted when the first byte of the line arrives. The state
+ * of escape sequences and lines is kept across calls.
+ */
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+#include "reredirect.h"
+
+#define ESC 0x1b
+
+enum { ANSI_NONE, ANSI_ESC, ANSI_CSI, ANSI_OSC, ANSI_OSC_ESC, ANSI_INTER };
+
+static const char *scan_scalar(const char *p, const char *end, char c) {
+    for (; p < end; p++)
+        if (*p == '\n' || *p == c)
+            return p;
+    return end;
+}
+
+#ifdef __SSE2__
+static const char *scan_sse2(const char *p, const char *end, char c) {
+    __m128i nl = _mm_set1_epi8('\n');
+    __m128i other = _mm_set1_epi8(c);
+    __m128i v;
+    int mask;
+
+    for (; end - p >= 16; p += 16) {
+        v = _mm_loadu_si128((const __m128i *)p);
+        mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(v, nl), _mm_cmpeq_epi8(v, other)));
+        if (mask)
+            return p + __builtin_ctz(mask);
+    }
+    return scan_scalar(p, end, c);
+}
+#endif
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("avx2")))
+static const char *scan_avx2(const char *p, const char *end, char c) {
+    __m256i nl = _mm256_set1_epi8('\n');
+    __m256i other = _mm256_set1_epi8(c);
+    __m256i v;
+    unsigned int mask;
+
+    for (; end - p >= 32; p += 32) {
+        v = _mm256_loadu_si256((const __m256i *)p);
+        mask = _mm256_movemask_epi8(_mm256_or_si256(_mm256_cmpeq_epi8(v, nl),
+                                                    _mm256_cmpeq_epi8(v, other)));
+        if (mask)
+            return p + __builtin_ctz(mask);
+    }
+    return scan_scalar(p, end, c);
+}
+#endif
+
+/* Return the name of the ISA used, or NULL if isa is not available */
+const char *line_filter_init(struct line_filter *f, int flags, const char *label, int isa) {
+    memset(f, 0, sizeof(*f));
+    f->flags = flags;
+    f->label = label;
+    f->bol = 1;
+    /* Only pick scanners that are built: SSE2 is optional on i386 */
+    if (isa == LINE_ISA_AUTO) {
+        isa = LINE_ISA_SCALAR;
+#if defined(__x86_64__) || defined(__i386__)
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2"))
+            isa = LINE_ISA_AVX2;
+#ifdef __SSE2__
+        else if (__builtin_cpu_supports("sse2"))
+            isa = LINE_ISA_SSE2;
+#endif
+#endif
+    }
+    switch (isa) {
+#if defined(__x86_64__) || defined(__i386__)
+        case LINE_ISA_AVX2:
+            if (!__builtin_cpu_supports("avx2"))
+                return NULL;
+            f->scan = scan_avx2;
+            return "avx2";
+#endif
+#ifdef __SSE2__
+        case LINE_ISA_SSE2:
+            f->scan = scan_sse2;
+            return "sse2";
+#endif
+        case LINE_ISA_SCALAR:
+            f->scan = scan_scalar;
+            return "scalar";
+    }
+    return NULL;
+}
+
+static int flush(struct line_filter *f, line_output_fn out, void *arg) {
+    int ret = f->len ? out(arg, f->buf, f->len) : 0;
+
+    f->len = 0;
+    return ret;
+}
+
+static int emit(struct line_filter *f, const char *p, size_t n, line_output_fn out, void *arg) {
+    if (f->len + n > sizeof(f->buf)) {
+        if (flush(f, out, arg))
+            return -1;
+        /* Large runs are not copied */
+        if (n > sizeof(f->buf) / 2)
+            return out(arg, p, n);
+    }
+    memcpy(f->buf + f->len, p, n);
+    f->len += n;
+    return 0;
+}
+
+static void format_header(struct line_filter *f) {
+    struct timespec ts;
+    struct tm tm;
+    char *p = f->header;
+    size_t size = sizeof(f->header);
+    int n = 0;
+
+    if (f->flags & LINE_TS_WALL) {
+        clock_gettime(CLOCK_REALTIME, &ts);
+        localtime_r(&ts.tv_sec, &tm);
+        n = strftime(p, size, "%Y-%m-%dT%H:%M:%S", &tm);
+        n += snprintf(p + n, size - n, ".%06ld ", ts.tv_nsec / 1000);
+    } else if (f->flags & LINE_TS_MONO) {
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        n = snprintf(p, size, "[%5ld.%06ld] ", (long)ts.tv_sec, ts.tv_nsec / 1000);
+    }
+    if (f->label && n < size)
+        n += snprintf(p + n, size - n, "%s ", f->label);
+    f->header_len = n < size ? n : size - 1;
+}
+
+/*
+ * Consume bytes of an escape sequence: CSI (ESC [ ... final byte), OSC
+ * (ESC ] ... BEL or ESC \) or ESC followed by intermediate bytes and a final
+ * byte. A newline always ends the sequence and is kept.
+ */
+static const char *ansi_skip(struct line_filter *f, const char *p, const char *end) {
+    unsigned char c;
+
+    for (; p < end && f->ansi != ANSI_NONE; p++) {
+        c = *p;
+        if (c == '\n') {
+            f->ansi = ANSI_NONE;
+            return p;
+        }
+        switch (f->ansi) {
+            case ANSI_ESC:
+                if (c == '[')
+                    f->ansi = ANSI_CSI;
+                else if (c == ']')
+                    f->ansi = ANSI_OSC;
+                else if (c >= 0x20 && c <= 0x2f)
+                    f->ansi = ANSI_INTER;
+                else
+                    f->ansi = ANSI_NONE;
+                break;
+            case ANSI_CSI:
+            case ANSI_INTER:
+                if (c >= 0x40 && c <= 0x7e)
+                    f->ansi = ANSI_NONE;
+                break;
+            case ANSI_OSC:
+                if (c == '\a')
+                    f->ansi = ANSI_NONE;
+                else if (c == ESC)
+                    f->ansi = ANSI_OSC_ESC;
+                break;
+            case ANSI_OSC_ESC:
+                f->ansi = c == '\\' ? ANSI_NONE : ANSI_OSC;
+                break;
+        }
+    }
+    return p;
+}
+
+/* Process n bytes of in and pass the result to out. Return -1 if out fails. */
+int line_filter_process(struct line_filter *f, const char *in, size_t n,
+                        line_output_fn out, void *arg) {
+    const char *p = in, *end = in + n, *q;
+    /* Without stripping, only look for newlines */
+    char other = f->flags & LINE_STRIP_ANSI ? ESC : '\n';
+    int headers = (f->flags & (LINE_TS_WALL | LINE_TS_MONO)) || f->label;
+
+    if (headers)
+        format_header(f);
+    while (p < end) {
+        if (f->ansi != ANSI_NONE) {
+            p = ansi_skip(f, p, end);
+            continue;
+        }
+        if (f->bol && headers && emit(f, f->header, f->header_len, out, arg))
+            return -1;
+        f->bol = 0;
+        q = f->scan(p, end, other);
+        if (emit(f, p, q - p, out, arg))
+            return -1;
+        if (q == end)
+            break;
+        if (*q == '\n') {
+            if (emit(f, q, 1, out, arg))
+                return -1;
+            f->bol = 1;
+        } else {
+            f->ansi = ANSI_ESC;
+        }
+        p = q + 1;
+    }
+    return flush(f, out, arg);
+}
@@ -19,6 +19,7 @@
  * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
  * THE SOFTWARE.
  */
+#define _GNU_SOURCE
 #include <sys/ptrace.h>
 #include <asm/ptrace.h>
 #include <sys/types.h>
@@ -31,8 +32,10 @@
 #include <string.h>
 #include <sys/syscall.h>
 #include <sys/mman.h>
+#include <sys/uio.h>
 #include <assert.h>
 #include <stddef.h>
+#include <stdint.h>
 
 #include "ptrace.h"
 
@@ -59,6 +62,10 @@
 #define PTRACE_EVENT_FORK 1
 #endif
 
+#ifndef PTRACE_EVENT_STOP
+#define PTRACE_EVENT_STOP 128
+#endif
+
 #define min(x, y) ({				\
 	typeof(x) _min1 = (x);			\
 	typeof(y) _min2 = (y);			\
@@ -80,6 +87,27 @@ struct ptrace_personality {
     size_t syscall_arg4;
     size_t syscall_arg5;
     size_t reg_ip;
+    /*
+     * Set if injected syscalls may be committed with a single
+     * PTRACE_SETREGS built from the cached register file, rather than one
+     * PTRACE_POKEUSER per register.
+     */
+    int batch_regs;
+};
+
+/*
+ * Small piece of code able to run a table of syscalls in the child without
+ * stopping. It loads the address of the table from the word at offset
+ * table_addr, runs entries until one has syscall number -1, and then
+ * raises SIGTRAP. Each entry is made of 9 words of word_size bytes: syscall
+ * number, address of first argument, arguments 1 to 5, return value and
+ * storage for the first argument.
+ */
+struct ptrace_stub {
+    const unsigned char *code;
+    size_t len;
+    size_t table_addr;
+    size_t word_size;
 };
 
 static struct ptrace_personality *personality(struct ptrace_child *child);
@@ -104,6 +132,70 @@ struct syscall_numbers arch_syscall_numbers[] = {
 };
 #endif
 
+static const struct {
+    long req;
+    const char *name;
+} stat_requests[PTRACE_STAT_REQUESTS] = {
+    { PTRACE_PEEKTEXT,    "PEEKTEXT" },
+    { PTRACE_PEEKDATA,    "PEEKDATA" },
+    { PTRACE_PEEKUSER,    "PEEKUSER" },
+    { PTRACE_POKEDATA,    "POKEDATA" },
+    { PTRACE_POKEUSER,    "POKEUSER" },
+    { PTRACE_GETREGS,     "GETREGS" },
+    { PTRACE_SETREGS,     "SETREGS" },
+    { PTRACE_SYSCALL,     "SYSCALL" },
+    { PTRACE_CONT,        "CONT" },
+    { PTRACE_ATTACH,      "ATTACH" },
+    { PTRACE_SEIZE,       "SEIZE" },
+    { PTRACE_INTERRUPT,   "INTERRUPT" },
+    { PTRACE_DETACH,      "DETACH" },
+    { PTRACE_SETOPTIONS,  "SETOPTIONS" },
+    { PTRACE_GETEVENTMSG, "GETEVENTMSG" },
+    { -1,                 "other" },
+};
+
+const char *ptrace_stat_request_name(int idx) {
+    if (idx < 0 || idx >= PTRACE_STAT_REQUESTS)
+        return NULL;
+    return stat_requests[idx].name;
+}
+
+static void stat_request(struct ptrace_child *child, long req) {
+    int i;
+
+    for (i = 0; i < PTRACE_STAT_REQUESTS - 1; i++)
+        if (stat_requests[i].req == req)
+            break;
+    child->stats.requests[i]++;
+}
+
+static struct ptrace_syscall_stat *stat_syscall_start(struct ptrace_child *child,
+                                                      long nr, int count) {
+    struct ptrace_syscall_stat *stat;
+
+    if (child->stats.nsyscalls >= PTRACE_STAT_SYSCALLS) {
+        stat = &child->stats.other;
+        stat->count += count;
+    } else {
+        stat = &child->stats.syscalls[child->stats.nsyscalls++];
+        stat->nr = nr;
+        stat->count = count;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &stat->start);
+    return stat;
+}
+
+static void stat_syscall_end(struct ptrace_child *child, struct ptrace_syscall_stat *stat) {
+    clock_gettime(CLOCK_MONOTONIC, &stat->end);
+    if (stat == &child->stats.other)
+        child->stats.other_ms += ptrace_elapsed_ms(&stat->start, &stat->end);
+}
+
+double ptrace_elapsed_ms(const struct timespec *from, const struct timespec *to) {
+    return (to->tv_sec - from->tv_sec) * 1e3 +
+           (to->tv_nsec - from->tv_nsec) / 1e6;
+}
+
 static struct ptrace_personality *personality(struct ptrace_child *child) {
     return &arch_personality[child->personality];
 }
@@ -112,21 +204,44 @@ struct syscall_numbers *ptrace_syscall_numbers(struct ptrace_child *child) {
     return &arch_syscall_numbers[child->personality];
 }
 
+size_t ptrace_word_size(struct ptrace_child *child) {
+    return arch_stub[child->personality].word_size;
+}
+
+/*
+ * Prefer PTRACE_SEIZE: unlike PTRACE_ATTACH, it does not send SIGSTOP to the
+ * process, so nothing is left for the process (or its parent) to observe.
+ * PTRACE_SEIZE is not available before Linux 3.4.
+ */
 int ptrace_attach_child(struct ptrace_child *child, pid_t pid) {
     memset(child, 0, sizeof *child);
     child->pid = pid;
-    if (ptrace_command(child, PTRACE_ATTACH) < 0)
+    clock_gettime(CLOCK_MONOTONIC, &child->stats.attach);
+    if (ptrace_command(child, PTRACE_SEIZE, 0,
+                       PTRACE_O_TRACESYSGOOD|PTRACE_O_TRACEFORK) == 0) {
+        child->seized = 1;
+        if (ptrace_command(child, PTRACE_INTERRUPT, 0, 0) < 0) {
+            /* Don't clobber child->error */
+            ptrace(PTRACE_DETACH, child->pid, 0, 0);
+            return -1;
+        }
+    } else if (child->error == EIO || child->error == EINVAL) {
+        if (ptrace_command(child, PTRACE_ATTACH) < 0)
+            return -1;
+    } else {
         return -1;
+    }
 
     return ptrace_finish_attach(child, pid);
 }
 
 int ptrace_finish_attach(struct ptrace_child *child, pid_t pid) {
-    memset(child, 0, sizeof *child);
     child->pid = pid;
+    child->state = ptrace_detached;
 
     if (ptrace_wait(child) < 0)
         goto detach;
+    clock_gettime(CLOCK_MONOTONIC, &child->stats.first_stop);
 
     if (arch_get_personality(child))
         goto detach;
@@ -144,13 +259,26 @@ int ptrace_finish_attach(struct ptrace_child *child, pid_t pid) {
 }
 
 int ptrace_detach_child(struct ptrace_child *child) {
-    if (ptrace_command(child, PTRACE_DETACH, 0, 0) < 0)
+    if (ptrace_command(child, PTRACE_DETACH, 0,
+                       (unsigned long)child->pending_sig) < 0)
         return -1;
+    child->pending_sig = 0;
     child->state = ptrace_detached;
+    clock_gettime(CLOCK_MONOTONIC, &child->stats.detach);
     return 0;
 }
 
+/*
+ * Besides syscall stops, a stopped child may be in:
+ *   - an event stop (status >> 16 is the event). With PTRACE_SEIZE, this
+ *     includes PTRACE_EVENT_STOP, reported for PTRACE_INTERRUPT and for
+ *     group-stops.
+ *   - a signal-delivery stop. With PTRACE_ATTACH, we can't tell our SIGSTOP
+ *     from others, so signals are discarded. With PTRACE_SEIZE, signal is
+ *     delivered on next resume.
+ */
 int ptrace_wait(struct ptrace_child *child) {
+    child->stats.waits++;
     if (waitpid(child->pid, &child->status, 0) < 0) {
         child->error = errno;
         return -1;
@@ -159,12 +287,15 @@ int ptrace_wait(struct ptrace_child *child) {
         child->state = ptrace_exited;
     } else if (WIFSTOPPED(child->status)) {
         int sig = WSTOPSIG(child->status);
+        int event = child->status >> 16;
         if (sig & 0x80) {
             child->state = (child->state == ptrace_at_syscall) ?
                 ptrace_after_syscall : ptrace_at_syscall;
         } else {
-            if (sig == SIGTRAP && (((child->status >> 8) & PTRACE_EVENT_FORK) == PTRACE_EVENT_FORK))
+            if (event == PTRACE_EVENT_FORK)
                 ptrace_command(child, PTRACE_GETEVENTMSG, 0, &child->forked_pid);
+            else if (!event && child->seized && sig != SIGTRAP)
+                child->pending_sig = sig;
             if (child->state != ptrace_at_syscall)
                 child->state = ptrace_stopped;
         }
@@ -186,14 +317,23 @@ int ptrace_advance_to_state(struct ptrace_child *child,
                 child->error = EAGAIN;
                 return -1;
             }
-            err = ptrace_command(child, PTRACE_SYSCALL, 0, 0);
+            err = ptrace_command(child, PTRACE_SYSCALL, 0,
+                                 (unsigned long)child->pending_sig);
+            child->pending_sig = 0;
             break;
         case ptrace_running:
-            return ptrace_command(child, PTRACE_CONT, 0, 0);
+            err = ptrace_command(child, PTRACE_CONT, 0,
+                                 (unsigned long)child->pending_sig);
+            child->pending_sig = 0;
+            return err;
         case ptrace_stopped:
-            err = kill(child->pid, SIGSTOP);
-            if (err < 0)
-                child->error = errno;
+            if (child->seized) {
+                err = ptrace_command(child, PTRACE_INTERRUPT, 0, 0);
+            } else {
+                err = kill(child->pid, SIGSTOP);
+                if (err < 0)
+                    child->error = errno;
+            }
             break;
         default:
             child->error = EINVAL;
@@ -203,6 +343,8 @@ int ptrace_advance_to_state(struct ptrace_child *child,
             return err;
         if (ptrace_wait(child) < 0)
             return -1;
+        if (child->state == ptrace_at_syscall && !child->stats.at_syscall.tv_sec)
+            clock_gettime(CLOCK_MONOTONIC, &child->stats.at_syscall);
     }
     return 0;
 }
@@ -227,15 +369,75 @@ int ptrace_restore_regs(struct ptrace_child *child) {
     return arch_restore_syscall(child);
 }
 
+#define reg(user, off) (*(unsigned long*)((void*)(user) + (off)))
+
+/*
+ * Prepare the whole register file from the saved one and commit it at once.
+ * The instruction pointer is rewound in the same request, so the child stops
+ * on the syscall instruction again at syscall exit and only the return value
+ * has to be fetched afterwards.
+ */
+static unsigned long remote_syscall_batched(struct ptrace_child *child,
+                                            unsigned long sysno,
+                                            unsigned long p0, unsigned long p1,
+                                            unsigned long p2, unsigned long p3,
+                                            unsigned long p4, unsigned long p5) {
+    struct ptrace_personality *pers = personality(child);
+    struct user regs = child->user;
+    unsigned long rv;
+
+    reg(&regs, pers->syscall_arg0) = p0;
+    reg(&regs, pers->syscall_arg1) = p1;
+    reg(&regs, pers->syscall_arg2) = p2;
+    reg(&regs, pers->syscall_arg3) = p3;
+    reg(&regs, pers->syscall_arg4) = p4;
+    reg(&regs, pers->syscall_arg5) = p5;
+    if (arch_set_syscall_regs(child, &regs, sysno) < 0)
+        return -1;
+    if (ptrace_command(child, PTRACE_SETREGS, 0, &regs) < 0)
+        return -1;
+
+    if (ptrace_advance_to_state(child, ptrace_after_syscall) < 0)
+        return -1;
+
+    rv = ptrace_command(child, PTRACE_PEEKUSER, pers->syscall_rv);
+    if (child->error)
+        return -1;
+    return rv;
+}
+
+static unsigned long remote_syscall(struct ptrace_child *child,
+                                    unsigned long sysno,
+                                    unsigned long p0, unsigned long p1,
+                                    unsigned long p2, unsigned long p3,
+                                    unsigned long p4, unsigned long p5);
+
 unsigned long ptrace_remote_syscall(struct ptrace_child *child,
                                     unsigned long sysno,
                                     unsigned long p0, unsigned long p1,
                                     unsigned long p2, unsigned long p3,
                                     unsigned long p4, unsigned long p5) {
+    struct ptrace_syscall_stat *stat;
+    unsigned long rv;
+
+    stat = stat_syscall_start(child, sysno, 1);
+    rv = remote_syscall(child, sysno, p0, p1, p2, p3, p4, p5);
+    stat_syscall_end(child, stat);
+    return rv;
+}
+
+static unsigned long remote_syscall(struct ptrace_child *child,
+                                    unsigned long sysno,
+                                    unsigned long p0, unsigned long p1,
+                                    unsigned long p2, unsigned long p3,
+                                    unsigned long p4, unsigned long p5) {
     unsigned long rv;
     if (ptrace_advance_to_state(child, ptrace_at_syscall) < 0)
         return -1;
 
+    if (personality(child)->batch_regs)
+        return remote_syscall_batched(child, sysno, p0, p1, p2, p3, p4, p5);
+
 #define setreg(r, v) do {                                               \
         if (ptrace_command(child, PTRACE_POKEUSER,                      \
                            personality(child)->r,                       \
@@ -260,18 +462,199 @@ unsigned long ptrace_remote_syscall(struct ptrace_child *child,
     if (child->error)
         return -1;
 
-    setreg(reg_ip, *(unsigned long*)((void*)&child->user +
-                                     personality(child)->reg_ip));
+    setreg(reg_ip, reg(&child->user, personality(child)->reg_ip));
 
     #undef setreg
 
     return rv;
 }
 
+void ptrace_put_word(unsigned char *dst, unsigned long val, size_t word_size) {
+    uint32_t val32 = val;
+
+    if (word_size == sizeof(val32))
+        memcpy(dst, &val32, sizeof(val32));
+    else
+        memcpy(dst, &val, sizeof(val));
+}
+
+unsigned long ptrace_get_word(const unsigned char *src, size_t word_size) {
+    int32_t val32;
+    unsigned long val;
+
+    if (word_size == sizeof(val32)) {
+        memcpy(&val32, src, sizeof(val32));
+        return (long)val32;
+    }
+    memcpy(&val, src, sizeof(val));
+    return val;
+}
+
+/*
+ * Skip current syscall and run code at addr until it raises SIGTRAP. arg is
+ * passed in the register of the first syscall argument. Then, go back to
+ * the interrupted syscall.
+ */
+static int run_code(struct ptrace_child *child, child_addr_t addr, unsigned long arg) {
+    struct user regs;
+    int sig;
+
+    regs = child->user;
+    reg(&regs, personality(child)->reg_ip) = addr;
+    reg(&regs, personality(child)->syscall_arg0) = arg;
+    arch_prepare_stub(child, &regs);
+    if (arch_set_syscall_regs(child, &regs, -1) < 0)
+        return -1;
+    if (ptrace_command(child, PTRACE_SETREGS, 0, &regs) < 0)
+        return -1;
+
+    child->state = ptrace_running;
+    if (ptrace_command(child, PTRACE_CONT, 0, 0) < 0)
+        return -1;
+    for (;;) {
+        if (ptrace_wait(child) < 0)
+            return -1;
+        if (child->state == ptrace_exited) {
+            child->error = ESRCH;
+            return -1;
+        }
+        if (WSTOPSIG(child->status) == SIGTRAP && !(child->status >> 16))
+            break;
+        /* Let the child handle signals received in the meantime */
+        sig = child->pending_sig;
+        if (!child->seized && !(child->status >> 16))
+            sig = WSTOPSIG(child->status);
+        child->pending_sig = 0;
+        child->state = ptrace_running;
+        if (ptrace_command(child, PTRACE_CONT, 0, (unsigned long)sig) < 0)
+            return -1;
+    }
+
+    if (ptrace_command(child, PTRACE_SETREGS, 0, &child->user) < 0)
+        return -1;
+    return ptrace_advance_to_state(child, ptrace_at_syscall);
+}
+
+int ptrace_run_code(struct ptrace_child *child, child_addr_t addr, unsigned long arg) {
+    if (ptrace_advance_to_state(child, ptrace_at_syscall) < 0)
+        return -1;
+    return run_code(child, addr, arg);
+}
+
+/*
+ * Run a whole sequence of syscalls with a single resume of the child. The
+ * stub and its table are written at addr, which has to be executable. On
+ * return, the child is stopped at syscall entry again, as for
+ * ptrace_remote_syscall(). Return -1 with child->error set to ENOSYS if the
+ * architecture does not provide a stub.
+ */
+int ptrace_remote_syscalls(struct ptrace_child *child, child_addr_t addr,
+                           size_t len, struct remote_syscall *calls, int n) {
+    struct ptrace_stub *stub = &arch_stub[child->personality];
+    size_t word = stub->word_size;
+    size_t op_size = 9 * word;
+    size_t table_off = (stub->len + word - 1) & ~(word - 1);
+    size_t total = table_off + (n + 1) * op_size;
+    child_addr_t table = addr + table_off;
+    struct ptrace_syscall_stat *stat;
+    unsigned char *buf, *op;
+    int ret = -1;
+    int i, j;
+
+    if (!stub->code) {
+        child->error = ENOSYS;
+        return -1;
+    }
+    if (total > len) {
+        child->error = ENOMEM;
+        return -1;
+    }
+    if (ptrace_advance_to_state(child, ptrace_at_syscall) < 0)
+        return -1;
+
+    stat = stat_syscall_start(child, -1, n);
+    buf = calloc(1, total);
+    if (!buf) {
+        child->error = errno;
+        goto out;
+    }
+    memcpy(buf, stub->code, stub->len);
+    ptrace_put_word(buf + stub->table_addr, table, word);
+    for (i = 0; i < n; i++) {
+        op = buf + table_off + i * op_size;
+        ptrace_put_word(op, calls[i].sysno, word);
+        if (calls[i].arg0_from >= 0)
+            ptrace_put_word(op + word, table + calls[i].arg0_from * op_size + 7 * word, word);
+        else
+            ptrace_put_word(op + word, table + i * op_size + 8 * word, word);
+        for (j = 1; j < 6; j++)
+            ptrace_put_word(op + (j + 1) * word, calls[i].args[j], word);
+        ptrace_put_word(op + 8 * word, calls[i].args[0], word);
+    }
+    ptrace_put_word(buf + table_off + n * op_size, -1, word);
+
+    if (ptrace_memcpy_to_child(child, addr, buf, total) < 0)
+        goto out;
+    if (arch_flush_stub(child, addr, total) < 0)
+        goto out;
+
+    if (run_code(child, addr, 0) < 0)
+        goto out;
+
+    op = buf + table_off;
+    if (ptrace_memcpy_from_child(child, op, table, n * op_size) < 0)
+        goto out;
+    for (i = 0; i < n; i++)
+        calls[i].rv = ptrace_get_word(op + i * op_size + 7 * word, word);
+    ret = 0;
+
+ out:
+    stat_syscall_end(child, stat);
+    free(buf);
+    return ret;
+}
+
+#undef reg
+
+/*
+ * Try to copy the whole buffer with a single process_vm_{read,write}v(). It
+ * may be unavailable (old kernel, missing capability, seccomp, ...). In this
+ * case, remember it and let caller fall back to word-by-word ptrace copy.
+ * Return number of bytes copied.
+ */
+static size_t vm_copy(struct ptrace_child *child, void *local,
+                      child_addr_t remote, size_t n, int to_child) {
+    struct iovec liov = { local, n };
+    struct iovec riov = { (void *)remote, n };
+    ssize_t ret;
+
+    if (child->no_vm_copy || !n)
+        return 0;
+    if (to_child)
+        ret = process_vm_writev(child->pid, &liov, 1, &riov, 1, 0);
+    else
+        ret = process_vm_readv(child->pid, &liov, 1, &riov, 1, 0);
+    child->copy_syscalls++;
+    child->stats.vm_copies++;
+    if (ret < 0) {
+        child->no_vm_copy = 1;
+        return 0;
+    }
+    return ret;
+}
+
 int ptrace_memcpy_to_child(struct ptrace_child *child, child_addr_t dst, const void *src, size_t n) {
     unsigned long scratch;
+    size_t done;
+
+    child->copy_syscalls = 0;
+    done = vm_copy(child, (void *)src, dst, n, 1);
+    dst += done;
+    src += done;
+    n -= done;
 
     while (n >= sizeof(unsigned long)) {
+        child->copy_syscalls++;
         if (ptrace_command(child, PTRACE_POKEDATA, dst, *((unsigned long*)src)) < 0)
             return -1;
         dst += sizeof(unsigned long);
@@ -280,6 +663,7 @@ int ptrace_memcpy_to_child(struct ptrace_child *child, child_addr_t dst, const v
     }
 
     if (n) {
+        child->copy_syscalls += 2;
         scratch = ptrace_command(child, PTRACE_PEEKDATA, dst);
         if (child->error)
             return -1;
@@ -293,9 +677,17 @@ int ptrace_memcpy_to_child(struct ptrace_child *child, child_addr_t dst, const v
 
 int ptrace_memcpy_from_child(struct ptrace_child *child, void *dst, child_addr_t src, size_t n) {
     unsigned long scratch;
+    size_t done;
+
+    child->copy_syscalls = 0;
+    done = vm_copy(child, dst, src, n, 0);
+    dst += done;
+    src += done;
+    n -= done;
 
     while (n) {
-         scratch = ptrace_command(child, PTRACE_PEEKDATA, src);
+        child->copy_syscalls++;
+        scratch = ptrace_command(child, PTRACE_PEEKDATA, src);
         if (child->error) return -1;
         memcpy(dst, &scratch, min(n, sizeof(unsigned long)));
 
@@ -312,6 +704,7 @@ int ptrace_memcpy_from_child(struct ptrace_child *child, void *dst, child_addr_t
 static long __ptrace_command(struct ptrace_child *child, PTRACE_REQUEST_TYPE req,
                              void *addr, void *data) {
     long rv;
+    stat_request(child, req);
     errno = 0;
     rv = ptrace(req, child->pid, addr, data);
     child->error = errno;
@@ -322,6 +715,7 @@ static long __ptrace_command(struct ptrace_child *child, PTRACE_REQUEST_TYPE req
 #ifdef BUILD_PTRACE_MAIN
 int main(int argc, char **argv) {
     struct ptrace_child child;
+    long mmap_syscall;
     pid_t pid;
 
     if (argc < 2) {
@@ -333,11 +727,13 @@ int main(int argc, char **argv) {
     assert(!ptrace_attach_child(&child, pid));
     assert(!ptrace_save_regs(&child));
 
+    mmap_syscall = ptrace_syscall_numbers(&child)->nr_mmap2;
+    if (mmap_syscall == -1)
+        mmap_syscall = ptrace_syscall_numbers(&child)->nr_mmap;
     printf("mmap = %lx\n", ptrace_remote_syscall(&child, mmap_syscall, 0,
                                                  4096, PROT_READ|PROT_WRITE,
                                                  MAP_ANONYMOUS|MAP_PRIVATE, 0, 0));
 
-    reset_user_struct(&child.user);
     assert(!ptrace_restore_regs(&child));
     assert(!ptrace_detach_child(&child));
 
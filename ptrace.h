@@ -24,6 +24,7 @@
 #include <sys/ptrace.h>
 #include <sys/user.h>
 #include <unistd.h>
+#include <time.h>
 
 /*
  * See https://github.com/nelhage/reptyr/issues/25 and
@@ -42,6 +43,12 @@
 #ifndef PTRACE_GETEVENTMSG
 #define PTRACE_GETEVENTMSG  0x4201
 #endif
+#ifndef PTRACE_SEIZE
+#define PTRACE_SEIZE        0x4206
+#endif
+#ifndef PTRACE_INTERRUPT
+#define PTRACE_INTERRUPT    0x4207
+#endif
 
 enum child_state {
     ptrace_detached = 0,
@@ -52,6 +59,39 @@ enum child_state {
     ptrace_exited
 };
 
+#define PTRACE_STAT_REQUESTS 16
+#define PTRACE_STAT_SYSCALLS 32
+
+/*
+ * A remote syscall, or a whole sequence run by ptrace_remote_syscalls() (in
+ * this case, nr is -1 and count is the number of syscalls).
+ */
+struct ptrace_syscall_stat {
+    long nr;
+    int count;
+    struct timespec start;
+    struct timespec end;
+};
+
+/*
+ * Timestamps (CLOCK_MONOTONIC) and counters collected while the child is
+ * traced. See ptrace_stat_request_name() for requests.
+ */
+struct ptrace_stats {
+    struct timespec attach;
+    struct timespec first_stop;
+    struct timespec at_syscall;
+    struct timespec detach;
+    unsigned long requests[PTRACE_STAT_REQUESTS];
+    unsigned long waits;
+    unsigned long vm_copies;
+    int nsyscalls;
+    struct ptrace_syscall_stat syscalls[PTRACE_STAT_SYSCALLS];
+    /* Remote syscalls which do not fit in syscalls, with their total time */
+    struct ptrace_syscall_stat other;
+    double other_ms;
+};
+
 struct ptrace_child {
     pid_t pid;
     enum child_state state;
@@ -61,6 +101,11 @@ struct ptrace_child {
     unsigned long forked_pid;
     struct user user;
     unsigned long saved_syscall;
+    int seized;
+    int pending_sig;
+    int no_vm_copy;
+    unsigned long copy_syscalls;
+    struct ptrace_stats stats;
 };
 
 struct syscall_numbers {
@@ -79,10 +124,29 @@ struct syscall_numbers {
     long nr_ioctl;
     long nr_dup;
     long nr_dup2;
+    long nr_fcntl;
+    long nr_fallocate;
+    long nr_lseek;
+    long nr_socket;
+    long nr_connect;
+    long nr_recvmsg;
+    long nr_socketcall;
 };
 
 typedef unsigned long child_addr_t;
 
+/*
+ * One syscall of a sequence run by ptrace_remote_syscalls(). If arg0_from is
+ * not -1, the first argument is taken from the result of this earlier call of
+ * the sequence instead of args[0].
+ */
+struct remote_syscall {
+    unsigned long sysno;
+    unsigned long args[6];
+    int arg0_from;
+    unsigned long rv;
+};
+
 int ptrace_wait(struct ptrace_child *child);
 int ptrace_attach_child(struct ptrace_child *child, pid_t pid);
 int ptrace_finish_attach(struct ptrace_child *child, pid_t pid);
@@ -97,9 +161,24 @@ unsigned long ptrace_remote_syscall(struct ptrace_child *child,
                                     unsigned long p0, unsigned long p1,
                                     unsigned long p2, unsigned long p3,
                                     unsigned long p4, unsigned long p5);
+int ptrace_remote_syscalls(struct ptrace_child *child, child_addr_t addr,
+                           size_t len, struct remote_syscall *calls, int n);
+/*
+ * Run code already written at addr in the child until it raises SIGTRAP.
+ * arg is passed in the register of the first syscall argument.
+ */
+int ptrace_run_code(struct ptrace_child *child, child_addr_t addr, unsigned long arg);
 
 int ptrace_memcpy_to_child(struct ptrace_child *, child_addr_t, const void*, size_t);
 int ptrace_memcpy_from_child(struct ptrace_child *, void*, child_addr_t, size_t);
 struct syscall_numbers *ptrace_syscall_numbers(struct ptrace_child *child);
+/* Size of a register (and of a syscall argument) in the child */
+size_t ptrace_word_size(struct ptrace_child *child);
+/* Store val at dst as a word of the child */
+void ptrace_put_word(unsigned char *dst, unsigned long val, size_t word_size);
+/* Load a word of the child from src, sign-extended */
+unsigned long ptrace_get_word(const unsigned char *src, size_t word_size);
+const char *ptrace_stat_request_name(int idx);
+double ptrace_elapsed_ms(const struct timespec *from, const struct timespec *to);
 #endif /* _PTRACE_H_ */
 
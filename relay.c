@@ -0,0 +1,743 @@
+/*
+ * Copyright (C) 2014 by Jérôme Pouiller <jezz@sysmic.org>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/*
+ * Relay mode: the target writes into pipes owned by reredirect and data are
+ * moved to our own outputs until we are interrupted or the target exits. The
+ * target is then restored to its previous outputs.
+ *
+ * The write side of the pipes is passed to the target with SCM_RIGHTS. If
+ * the target is in another network namespace, it opens it through
+ * /proc/OURPID/fd/N instead, which needs the same uid.
+ *
+ * Outputs can also be written to files. These files can be rotated by size,
+ * age or on SIGHUP without stopping the target again.
+ *
+ * In ring mode, data are only kept in memory (oldest data are overwritten)
+ * and written on SIGUSR1 or on exit. So a slow reader never blocks the target.
+ *
+ * Lines can be timestamped, prefixed and stripped of ANSI sequences on the
+ * way (see lines.c). Both streams can also be written as records of a
+ * capture store (see capture.c).
+ *
+ * Files can be written with io_uring (see uring.c): the relay then reads the
+ * pipes directly into registered buffers and goes on while the writes are in
+ * flight.
+ */
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <signal.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <limits.h>
+#include <glob.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <sys/signalfd.h>
+#include <sys/wait.h>
+#include <sys/syscall.h>
+
+#include "reredirect.h"
+
+#ifndef SYS_pidfd_open
+#define SYS_pidfd_open 434
+#endif
+
+#define RELAY_CHUNK (64 * 1024)
+/* Partial blocks are compressed after this delay */
+#define RELAY_GZ_FLUSH_MS 1000
+/* Partial io_uring buffers are written after this delay */
+#define RELAY_URING_FLUSH_MS 100
+
+struct relay_ring {
+    char *buf;
+    size_t size;
+    size_t start;
+    size_t len;
+    unsigned long long dropped;
+    char *out;          /* Copy of the ring being dumped to a plain fd */
+    size_t out_len;
+    size_t out_done;
+    unsigned long long out_dropped;
+    int dumping;
+};
+
+struct relay_sink {
+    const char *path;   /* NULL for our own outputs, never rotated */
+    int fd;
+    unsigned long long size;
+    struct timespec opened;
+    struct gz_sink *gz;
+    struct timespec gz_since;   /* Age of the partial block */
+    struct relay_ring *ring;
+    struct capture *capture;
+    struct uring_sink *uring;
+    struct timespec uring_since;    /* Age of the partial buffer */
+};
+
+struct relay_stream {
+    int orig_fd;
+    int pipe[2];
+    struct relay_sink *sink;
+    int save_fd;
+    int no_splice;
+    int sink_full;      /* Wait for room in the sink before moving data */
+    unsigned long long bytes;
+    struct line_filter *filter;
+    char label[32];
+    pid_t pid;
+};
+
+/* Keep the last ring->size bytes written */
+static void ring_write(struct relay_ring *ring, const char *buf, size_t n) {
+    size_t over, pos, part;
+
+    if (n > ring->size) {
+        ring->dropped += n - ring->size;
+        buf += n - ring->size;
+        n = ring->size;
+    }
+    if (ring->len + n > ring->size) {
+        over = ring->len + n - ring->size;
+        ring->dropped += over;
+        ring->start = (ring->start + over) % ring->size;
+        ring->len -= over;
+    }
+    pos = (ring->start + ring->len) % ring->size;
+    part = ring->size - pos < n ? ring->size - pos : n;
+    memcpy(ring->buf + pos, buf, part);
+    memcpy(ring->buf, buf + part, n - part);
+    ring->len += n;
+}
+
+static int sink_output(struct relay_sink *sink, const char *buf, size_t n) {
+    ssize_t ret;
+    size_t done;
+
+    if (sink->gz) {
+        if (!gz_sink_pending(sink->gz))
+            clock_gettime(CLOCK_MONOTONIC, &sink->gz_since);
+        gz_sink_write(sink->gz, buf, n);
+        return 0;
+    }
+    if (sink->uring) {
+        if (!uring_sink_pending(sink->uring))
+            clock_gettime(CLOCK_MONOTONIC, &sink->uring_since);
+        uring_sink_write(sink->uring, buf, n);
+        sink->size += n;
+        return 0;
+    }
+    for (done = 0; done < n; done += ret) {
+        ret = write(sink->fd, buf + done, n - done);
+        if (ret < 0)
+            return -1;
+    }
+    sink->size += n;
+    return 0;
+}
+
+static const char *sink_name(const struct relay_sink *sink) {
+    return sink->path ? sink->path : sink->fd == 1 ? "stdout" : "stderr";
+}
+
+/* Write the next part of the dump without blocking, return 1 while some is left */
+static int sink_dump_write(struct relay_sink *sink) {
+    struct relay_ring *ring = sink->ring;
+    ssize_t ret;
+    size_t n;
+
+    if (!ring || !ring->dumping)
+        return 0;
+    if (ring->out_done < ring->out_len) {
+        /* POLLOUT only promises room for PIPE_BUF bytes */
+        n = ring->out_len - ring->out_done;
+        ret = write(sink->fd, ring->out + ring->out_done, n < PIPE_BUF ? n : PIPE_BUF);
+        if (ret < 0 && (errno == EAGAIN || errno == EINTR))
+            return 1;
+        if (ret < 0) {
+            error("Cannot dump ring to %s: %s", sink_name(sink), strerror(errno));
+            ring->dumping = 0;
+            return 0;
+        }
+        ring->out_done += ret;
+        sink->size += ret;
+        if (ring->out_done < ring->out_len)
+            return 1;
+    }
+    fprintf(stderr, "# Dumped %zu bytes to %s, %llu bytes dropped\n",
+            ring->out_len, sink_name(sink), ring->out_dropped);
+    ring->dumping = 0;
+    return 0;
+}
+
+/*
+ * Write content of the ring to the sink and empty it. A plain fd may have a
+ * slow reader: the content is copied aside and written by sink_dump_write()
+ * each time the main loop sees the fd writable, so streams are still read
+ * meanwhile.
+ */
+static void sink_dump(struct relay_sink *sink) {
+    struct relay_ring *ring = sink->ring;
+    size_t part;
+
+    if (!ring)
+        return;
+    if (ring->dumping) {
+        debug("Previous dump to %s is not finished", sink_name(sink));
+        return;
+    }
+    part = ring->size - ring->start < ring->len ? ring->size - ring->start : ring->len;
+    if (sink->gz || sink->uring) {
+        /* These sinks only queue data */
+        if (sink_output(sink, ring->buf + ring->start, part) ||
+            sink_output(sink, ring->buf, ring->len - part))
+            error("Cannot dump ring to %s: %s", sink_name(sink), strerror(errno));
+        fprintf(stderr, "# Dumped %zu bytes to %s, %llu bytes dropped\n",
+                ring->len, sink_name(sink), ring->dropped);
+    } else {
+        if (!ring->out && !(ring->out = malloc(ring->size)))
+            die("Cannot allocate memory");
+        memcpy(ring->out, ring->buf + ring->start, part);
+        memcpy(ring->out + part, ring->buf, ring->len - part);
+        ring->out_len = ring->len;
+        ring->out_done = 0;
+        ring->out_dropped = ring->dropped;
+        ring->dumping = 1;
+    }
+    ring->start = ring->len = 0;
+}
+
+/* Finish the dump in progress and dump what is left, waiting for the sink */
+static void sink_dump_wait(struct relay_sink *sink) {
+    struct pollfd pfd = { sink->fd, POLLOUT, 0 };
+
+    while (sink_dump_write(sink))
+        poll(&pfd, 1, -1);
+    sink_dump(sink);
+    while (sink_dump_write(sink))
+        poll(&pfd, 1, -1);
+}
+
+static int stream_output(void *arg, const char *buf, size_t n) {
+    struct relay_stream *s = arg;
+
+    if (s->sink->ring) {
+        ring_write(s->sink->ring, buf, n);
+        return 0;
+    }
+    if (s->sink->capture)
+        return capture_write(s->sink->capture, s->pid, s->orig_fd, buf, n);
+    return sink_output(s->sink, buf, n);
+}
+
+/*
+ * Move available data from the pipe to the sink. splice() does not copy data
+ * to user space, but it is not supported by every destination (e.g. some
+ * terminals). In this case, fall back to read()/write(). In ring mode, the
+ * pipe is always emptied immediately. With io_uring, data are read directly
+ * into the buffer of the next write.
+ */
+static ssize_t relay_move(struct relay_stream *s) {
+    char buf[RELAY_CHUNK];
+    size_t space;
+    ssize_t n;
+    char *p;
+
+    if (s->sink->uring && !s->filter) {
+        p = uring_sink_buffer(s->sink->uring, &space);
+        n = read(s->pipe[0], p, space);
+        if (n <= 0)
+            return n;
+        if (!uring_sink_pending(s->sink->uring))
+            clock_gettime(CLOCK_MONOTONIC, &s->sink->uring_since);
+        uring_sink_commit(s->sink->uring, n);
+        s->bytes += n;
+        s->sink->size += n;
+        return n;
+    }
+    if (!s->no_splice && !s->sink->gz && !s->sink->ring && !s->filter && !s->sink->capture &&
+        !s->sink->uring) {
+        n = splice(s->pipe[0], NULL, s->sink->fd, NULL, RELAY_CHUNK,
+                   SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (n > 0) {
+            s->bytes += n;
+            s->sink->size += n;
+        }
+        /* Either the pipe is empty or the sink is full, the caller polls the sink */
+        if (n < 0 && errno == EAGAIN) {
+            int queued;
+
+            s->sink_full = !ioctl(s->pipe[0], FIONREAD, &queued) && queued > 0;
+        }
+        if (n >= 0 || errno != EINVAL)
+            return n;
+        debug("splice() not supported on fd %d, using read()/write()", s->sink->fd);
+        s->no_splice = 1;
+    }
+
+    n = read(s->pipe[0], buf, sizeof(buf));
+    if (n <= 0)
+        return n;
+    s->bytes += n;
+    if (s->filter)
+        return line_filter_process(s->filter, buf, n, stream_output, s) ? -1 : n;
+    return stream_output(s, buf, n) ? -1 : n;
+}
+
+static int sink_open(struct relay_sink *sink) {
+    struct stat st;
+
+    sink->fd = open(sink->path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0666);
+    if (sink->fd < 0) {
+        error("Cannot open %s: %s", sink->path, strerror(errno));
+        return errno;
+    }
+    sink->size = fstat(sink->fd, &st) ? 0 : st.st_size;
+    clock_gettime(CLOCK_MONOTONIC, &sink->opened);
+    return 0;
+}
+
+static void sink_compress(const char *path, const char *compress) {
+    pid_t pid = fork();
+
+    if (pid < 0) {
+        error("Cannot compress %s: %s", path, strerror(errno));
+    } else if (!pid) {
+        sigset_t empty;
+
+        /* The blocked mask of the relay survives exec() */
+        sigemptyset(&empty);
+        sigprocmask(SIG_SETMASK, &empty, NULL);
+        execlp(compress, compress, path, (char *)NULL);
+        error("Cannot run %s: %s", compress, strerror(errno));
+        _exit(1);
+    }
+}
+
+/* Check if path or a compressed version of it (path.gz, etc.) exists */
+static int rotated_exists(const char *path) {
+    char pattern[PATH_MAX + 2];
+    glob_t g;
+    int ret;
+
+    if (!access(path, F_OK))
+        return 1;
+    snprintf(pattern, sizeof(pattern), "%s.*", path);
+    ret = !glob(pattern, GLOB_NOSORT, NULL, &g);
+    if (ret)
+        globfree(&g);
+    return ret;
+}
+
+/* After a failed rotation, wait for a full period before the next attempt */
+static void sink_rotate_later(struct relay_sink *sink) {
+    sink->size = 0;
+    if (sink->gz)
+        gz_sink_set_fd(sink->gz, sink->fd);
+    clock_gettime(CLOCK_MONOTONIC, &sink->opened);
+}
+
+/*
+ * Rename current file to FILE.YYYYmmdd-HHMMSS and start a new one. The old
+ * file stays open until the new one is ready, so no data is lost if the new
+ * file cannot be opened. If the current file was removed, only reopen it.
+ */
+static void sink_rotate(struct relay_sink *sink, const struct relay_options *opts) {
+    char suffix[32], path[PATH_MAX];
+    struct tm tm;
+    time_t now;
+    int old_fd, i;
+
+    now = time(NULL);
+    localtime_r(&now, &tm);
+    strftime(suffix, sizeof(suffix), "%Y%m%d-%H%M%S", &tm);
+    snprintf(path, sizeof(path), "%s.%s", sink->path, suffix);
+    for (i = 1; rotated_exists(path); i++)
+        snprintf(path, sizeof(path), "%s.%s-%d", sink->path, suffix, i);
+    if (rename(sink->path, path)) {
+        if (errno != ENOENT) {
+            error("Cannot rename %s to %s: %s", sink->path, path, strerror(errno));
+            sink_rotate_later(sink);
+            return;
+        }
+        debug("%s was removed, reopening it", sink->path);
+        path[0] = '\0';
+    }
+    old_fd = sink->fd;
+    /* Pending data belong to the rotated file */
+    if (sink->gz)
+        gz_sink_flush(sink->gz);
+    if (sink->uring)
+        uring_sink_flush(sink->uring);
+    if (sink_open(sink)) {
+        sink->fd = old_fd;
+        sink_rotate_later(sink);
+        return;
+    }
+    if (sink->gz)
+        gz_sink_set_fd(sink->gz, sink->fd);
+    if (sink->uring)
+        uring_sink_set_fd(sink->uring, sink->fd);
+    close(old_fd);
+    if (!path[0])
+        return;
+    debug("Rotated %s to %s", sink->path, path);
+    if (opts->compress)
+        sink_compress(path, opts->compress);
+}
+
+static int sink_need_rotate(const struct relay_sink *sink, const struct relay_options *opts,
+                            const struct timespec *now) {
+    unsigned long long size = sink->size;
+
+    if (!sink->path)
+        return 0;
+    if (sink->gz)
+        size += gz_sink_written(sink->gz);
+    if (opts->rotate_size && size >= opts->rotate_size)
+        return 1;
+    if (opts->rotate_time && now->tv_sec - sink->opened.tv_sec >= opts->rotate_time)
+        return 1;
+    return 0;
+}
+
+static long elapsed_ms(const struct timespec *from, const struct timespec *to) {
+    return (to->tv_sec - from->tv_sec) * 1000 + (to->tv_nsec - from->tv_nsec) / 1000000;
+}
+
+/* Compress the partial block if nothing filled it for a while */
+static void sink_gz_idle(struct relay_sink *sink, const struct timespec *now) {
+    if (!sink->gz || !gz_sink_pending(sink->gz))
+        return;
+    if (elapsed_ms(&sink->gz_since, now) >= RELAY_GZ_FLUSH_MS)
+        gz_sink_submit(sink->gz);
+}
+
+/* Queue the partial io_uring buffer if nothing filled it for a while */
+static void sink_uring_idle(struct relay_sink *sink, const struct timespec *now) {
+    if (!sink->uring)
+        return;
+    if (uring_sink_pending(sink->uring) &&
+        elapsed_ms(&sink->uring_since, now) >= RELAY_URING_FLUSH_MS)
+        uring_sink_submit(sink->uring);
+    uring_sink_kick(sink->uring);
+}
+
+/* Time in ms until the next rotation by age or idle flush, or -1 */
+static int sink_timeout(const struct relay_sink *sinks, int n, const struct relay_options *opts,
+                        const struct timespec *now) {
+    long ms, ret = -1;
+    int i;
+
+    for (i = 0; i < n; i++) {
+        if (sinks[i].gz && gz_sink_pending(sinks[i].gz)) {
+            ms = RELAY_GZ_FLUSH_MS - elapsed_ms(&sinks[i].gz_since, now);
+            if (ms < 0)
+                ms = 0;
+            if (ret < 0 || ms < ret)
+                ret = ms;
+        }
+        if (sinks[i].uring && uring_sink_pending(sinks[i].uring)) {
+            ms = RELAY_URING_FLUSH_MS - elapsed_ms(&sinks[i].uring_since, now);
+            if (ms < 0)
+                ms = 0;
+            if (ret < 0 || ms < ret)
+                ret = ms;
+        }
+        if (!sinks[i].path || !opts->rotate_time)
+            continue;
+        ms = (sinks[i].opened.tv_sec + opts->rotate_time - now->tv_sec) * 1000 -
+             now->tv_nsec / 1000000 + sinks[i].opened.tv_nsec / 1000000;
+        if (ms < 0)
+            ms = 0;
+        if (ret < 0 || ms < ret)
+            ret = ms;
+    }
+    return ret;
+}
+
+static void relay_drain(struct relay_stream *streams, int n) {
+    int i;
+
+    for (i = 0; i < n; i++) {
+        if (streams[i].pipe[0] < 0)
+            continue;
+        while (relay_move(&streams[i]) > 0 || streams[i].sink_full) {
+            struct pollfd pfd = { streams[i].sink->fd, POLLOUT, 0 };
+
+            if (streams[i].sink_full && poll(&pfd, 1, -1) < 0 && errno != EINTR)
+                break;
+            streams[i].sink_full = 0;
+        }
+    }
+}
+
+static int relay_restore(pid_t pid, struct relay_stream *streams, int n, int stub) {
+    struct ptrace_child child;
+    struct child_redirect redirs[n];
+    int orig_fd, i, m = 0;
+
+    /*
+     * A stream at EOF keeps the fd the target replaced it with. Only close
+     * its saved fd: dup2() of a fd onto itself does nothing.
+     */
+    for (i = 0; i < n; i++) {
+        if (streams[i].save_fd < 0)
+            continue;
+        orig_fd = streams[i].pipe[0] < 0 ? streams[i].save_fd : streams[i].orig_fd;
+        redirs[m++] = (struct child_redirect){ orig_fd, NULL, streams[i].save_fd, -1 };
+    }
+    return m ? child_redirect(pid, &child, redirs, m, 0, stub) : 0;
+}
+
+/*
+ * Relay stdout and stderr of pid to our stdout and stderr, or to the files
+ * given in opts. Return 0 once the target is restored or has exited.
+ */
+int relay(pid_t pid, const struct relay_options *opts) {
+    struct relay_sink sinks[2] = {
+        { .path = opts->files[0], .fd = 1 },
+        { .path = opts->files[1], .fd = 2 },
+    };
+    struct relay_stream streams[2] = {
+        { .orig_fd = 1, .sink = &sinks[0], .pid = pid },
+        { .orig_fd = 2, .sink = &sinks[1], .pid = pid },
+    };
+    struct signalfd_siginfo si;
+    struct child_redirect redirs[2];
+    struct ptrace_child child;
+    struct timespec now;
+    struct pollfd pfd[6];
+    char paths[2][64];
+    sigset_t mask;
+    int pidfd, sigfd, timeout;
+    int err, i, send;
+
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGTERM);
+    sigaddset(&mask, SIGHUP);
+    sigaddset(&mask, SIGUSR1);
+    sigprocmask(SIG_BLOCK, &mask, NULL);
+    sigfd = signalfd(-1, &mask, SFD_CLOEXEC);
+    if (sigfd < 0)
+        die("Cannot create signalfd: %s", strerror(errno));
+
+    /* With -m, both streams go to the same file */
+    if (sinks[0].path && sinks[1].path && !strcmp(sinks[0].path, sinks[1].path)) {
+        streams[1].sink = &sinks[0];
+        sinks[1].path = NULL;
+    }
+    if (opts->capture) {
+        sinks[0].capture = capture_open(opts->capture);
+        if (!sinks[0].capture)
+            return errno;
+        streams[1].sink = &sinks[0];
+    }
+    /* Compression threads inherit the signal mask set above */
+    for (i = 0; i < 2; i++) {
+        if (streams[i].sink != &sinks[i])
+            continue;
+        if (sinks[i].path && (err = sink_open(&sinks[i])))
+            return err;
+        if (opts->gzip_level) {
+            sinks[i].gz = gz_sink_new(sinks[i].fd, opts->gzip_level, opts->gzip_threads);
+            if (!sinks[i].gz)
+                return EINVAL;
+        }
+        if (opts->ring_size) {
+            sinks[i].ring = calloc(1, sizeof(*sinks[i].ring));
+            if (!sinks[i].ring || !(sinks[i].ring->buf = malloc(opts->ring_size)))
+                die("Cannot allocate memory");
+            sinks[i].ring->size = opts->ring_size;
+        }
+        /* Without io_uring, files are written as usual */
+        if (opts->uring && sinks[i].path) {
+            sinks[i].uring = uring_sink_new(sinks[i].fd, opts->uring_direct, opts->uring_fsync);
+            debug("%s is written with %s", sinks[i].path, sinks[i].uring ? "io_uring" : "write()");
+        }
+    }
+
+    for (i = 0; i < 2 && (opts->line_flags || opts->prefix); i++) {
+        streams[i].filter = malloc(sizeof(*streams[i].filter));
+        if (!streams[i].filter)
+            die("Cannot allocate memory");
+        snprintf(streams[i].label, sizeof(streams[i].label), "[%d:%s]", pid, i ? "err" : "out");
+        debug("Line processing of fd %d uses %s", streams[i].orig_fd,
+              line_filter_init(streams[i].filter, opts->line_flags,
+                               opts->prefix ? streams[i].label : NULL, LINE_ISA_AUTO));
+    }
+
+    pidfd = syscall(SYS_pidfd_open, pid, 0);
+    if (pidfd < 0 && errno != ENOSYS)
+        return errno;
+
+    /* A closed fd would be redirected but could not be saved and restored */
+    for (i = 0; i < 2; i++) {
+        if (child_fd_flags(pid, streams[i].orig_fd) < 0) {
+            error("fd %d of %d is not open", streams[i].orig_fd, pid);
+            return EBADF;
+        }
+    }
+
+    send = opts->send || child_same_netns(pid);
+    if (!send)
+        debug("%d is in another network namespace, it opens the pipes through /proc", pid);
+    for (i = 0; i < 2; i++) {
+        if (pipe2(streams[i].pipe, O_CLOEXEC))
+            die("Cannot create pipe: %s", strerror(errno));
+        fcntl(streams[i].pipe[0], F_SETFL, O_NONBLOCK);
+        if (opts->pipe_size && fcntl(streams[i].pipe[0], F_SETPIPE_SZ, opts->pipe_size) < 0)
+            error("Unable to set pipe size: %s", strerror(errno));
+        debug("Pipe size of fd %d: %d", streams[i].orig_fd,
+              fcntl(streams[i].pipe[0], F_GETPIPE_SZ));
+        snprintf(paths[i], sizeof(paths[i]), "/proc/%d/fd/%d", getpid(), streams[i].pipe[1]);
+        if (send)
+            redirs[i] = (struct child_redirect){ streams[i].orig_fd, NULL, streams[i].pipe[1], -1,
+                                                 .send = 1 };
+        else
+            /* The target must not hold a read side of its own outputs */
+            redirs[i] = (struct child_redirect){ streams[i].orig_fd, paths[i], -1, -1,
+                                                 .flags = O_WRONLY };
+    }
+
+    err = child_redirect(pid, &child, redirs, 2, 1, opts->stub);
+    if (err)
+        return err;
+    err = 0;
+    for (i = 0; i < 2; i++) {
+        streams[i].save_fd = redirs[i].save_fd;
+        close(streams[i].pipe[1]);
+        if (streams[i].save_fd < 0) {
+            error("Unable to save fd %d of %d", streams[i].orig_fd, pid);
+            err = EIO;
+        }
+    }
+    /* Give back the other stream before its pipe loses its reader */
+    if (err) {
+        relay_restore(pid, streams, 2, opts->stub);
+        return err;
+    }
+    debug("Relaying outputs of %d", pid);
+
+    for (;;) {
+        /* A stream waits for its sink to have room before reading its pipe again */
+        for (i = 0; i < 2; i++) {
+            pfd[i].fd = streams[i].sink_full ? streams[i].sink->fd : streams[i].pipe[0];
+            pfd[i].events = streams[i].sink_full ? POLLOUT : POLLIN;
+        }
+        pfd[2].fd = sigfd;
+        pfd[2].events = POLLIN;
+        pfd[3].fd = pidfd;
+        pfd[3].events = POLLIN;
+        /* Negative fds are ignored by poll() */
+        for (i = 0; i < 2; i++) {
+            pfd[4 + i].fd = sinks[i].ring && sinks[i].ring->dumping ? sinks[i].fd : -1;
+            pfd[4 + i].events = POLLOUT;
+        }
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        timeout = sink_timeout(sinks, 2, opts, &now);
+        /* Without pidfd, check the target from time to time */
+        if (pidfd < 0 && (timeout < 0 || timeout > 1000))
+            timeout = 1000;
+        if (poll(pfd, 6, timeout) < 0) {
+            if (errno == EINTR)
+                continue;
+            die("poll: %s", strerror(errno));
+        }
+        for (i = 0; i < 2; i++) {
+            if (!(pfd[i].revents & (POLLIN | POLLOUT | POLLERR | POLLHUP)))
+                continue;
+            streams[i].sink_full = 0;
+            /* The target closed or replaced the fd, the pipe stays at EOF */
+            if (!relay_move(&streams[i])) {
+                debug("fd %d of %d is no longer relayed", streams[i].orig_fd, pid);
+                close(streams[i].pipe[0]);
+                streams[i].pipe[0] = -1;
+            }
+        }
+        for (i = 0; i < 2; i++)
+            if (pfd[4 + i].revents & (POLLOUT | POLLERR | POLLHUP))
+                sink_dump_write(&sinks[i]);
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        for (i = 0; i < 2; i++) {
+            sink_gz_idle(&sinks[i], &now);
+            sink_uring_idle(&sinks[i], &now);
+            if (sink_need_rotate(&sinks[i], opts, &now))
+                sink_rotate(&sinks[i], opts);
+        }
+        while (waitpid(-1, NULL, WNOHANG) > 0)
+            ;
+        if (pfd[2].revents & POLLIN) {
+            if (read(sigfd, &si, sizeof(si)) != sizeof(si))
+                si.ssi_signo = SIGINT;
+            if (si.ssi_signo == SIGHUP && (sinks[0].path || sinks[1].path)) {
+                for (i = 0; i < 2; i++)
+                    if (sinks[i].path)
+                        sink_rotate(&sinks[i], opts);
+                continue;
+            }
+            if (si.ssi_signo == SIGUSR1) {
+                for (i = 0; i < 2; i++)
+                    sink_dump(&sinks[i]);
+                continue;
+            }
+            debug("Interrupted, restoring outputs of %d", pid);
+            err = relay_restore(pid, streams, 2, opts->stub);
+            break;
+        }
+        if ((pidfd >= 0 && (pfd[3].revents & POLLIN)) || (pidfd < 0 && kill(pid, 0))) {
+            debug("Process %d exited", pid);
+            err = 0;
+            break;
+        }
+    }
+    relay_drain(streams, 2);
+    debug("Relayed %llu bytes from stdout and %llu bytes from stderr",
+          streams[0].bytes, streams[1].bytes);
+    for (i = 0; i < 2; i++) {
+        sink_dump_wait(&sinks[i]);
+        if (sinks[i].ring) {
+            free(sinks[i].ring->out);
+            free(sinks[i].ring->buf);
+            free(sinks[i].ring);
+        }
+        if (sinks[i].gz)
+            gz_sink_free(sinks[i].gz);
+        if (sinks[i].uring)
+            uring_sink_free(sinks[i].uring);
+        if (sinks[i].capture)
+            capture_close(sinks[i].capture);
+        if (sinks[i].path && streams[i].sink == &sinks[i])
+            close(sinks[i].fd);
+        free(streams[i].filter);
+    }
+    /* Let compression of rotated files finish */
+    while (wait(NULL) > 0)
+        ;
+    return err;
+}
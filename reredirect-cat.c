@@ -0,0 +1,250 @@
+/*
+ * Copyright (C) 2014 by Jérôme Pouiller <jezz@sysmic.org>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+/*
+ * Print records of a capture store written by reredirect --relay --capture.
+ * With --since, the index is used to seek close to the first record instead
+ * of reading the whole store.
+ */
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <getopt.h>
+#include <limits.h>
+#include <time.h>
+#include <endian.h>
+
+#include "reredirect.h"
+
+static const char *stream_names[] = { "in", "out", "err" };
+
+static void usage(void) {
+    char *me = program_invocation_short_name;
+    fprintf(stderr, "Usage: %s [--since=TIME] [--until=TIME] [--pid=PID] [--stream=STREAM] [-r] FILE\n", me);
+    fprintf(stderr, "%s prints records of a capture store written by reredirect --capture.\n", me);
+    fprintf(stderr, "  --since=TIME, --until=TIME\n");
+    fprintf(stderr, "           Only print records written in this range. TIME is\n");
+    fprintf(stderr, "           YYYY-mm-ddTHH:MM:SS[.frac] (local time) or @SECONDS since epoch.\n");
+    fprintf(stderr, "  --pid=PID\n");
+    fprintf(stderr, "           Only print records of PID.\n");
+    fprintf(stderr, "  --stream=STREAM\n");
+    fprintf(stderr, "           Only print records of STREAM: 0, 1, 2, in, out or err.\n");
+    fprintf(stderr, "  -r, --records\n");
+    fprintf(stderr, "           Print time, pid and stream before each record.\n");
+}
+
+void die(const char *msg, ...) {
+    va_list ap;
+
+    fprintf(stderr, "[!] ");
+    va_start(ap, msg);
+    vfprintf(stderr, msg, ap);
+    va_end(ap);
+    fprintf(stderr, "\n");
+    exit(1);
+}
+
+/* Return time in ns since epoch, or 0 on error */
+static unsigned long long parse_time(const char *str) {
+    const char *frac;
+    unsigned long long ns = 0;
+    unsigned long long scale = 100000000;
+    struct tm tm;
+    time_t sec;
+
+    if (str[0] == '@') {
+        sec = strtoll(str + 1, (char **)&frac, 10);
+    } else {
+        memset(&tm, 0, sizeof(tm));
+        frac = strptime(str, "%Y-%m-%dT%H:%M:%S", &tm);
+        if (!frac)
+            frac = strptime(str, "%Y-%m-%d %H:%M:%S", &tm);
+        if (!frac)
+            return 0;
+        tm.tm_isdst = -1;
+        sec = mktime(&tm);
+    }
+    if (*frac == '.')
+        for (frac++; *frac >= '0' && *frac <= '9'; frac++, scale /= 10)
+            ns += (*frac - '0') * scale;
+    if (*frac || sec <= 0)
+        return 0;
+    return sec * 1000000000ULL + ns;
+}
+
+static int parse_stream(const char *str) {
+    int i;
+
+    for (i = 0; i < 3; i++)
+        if (!strcmp(str, stream_names[i]) || (str[0] == '0' + i && !str[1]))
+            return i;
+    die("Invalid stream: %s", str);
+}
+
+/* Offset of the last indexed record written before since */
+static off_t index_seek(const char *path, unsigned long long since) {
+    char idx_path[PATH_MAX], magic[CAPTURE_MAGIC_LEN];
+    struct capture_index entry;
+    off_t lo, hi, mid, ret = CAPTURE_MAGIC_LEN;
+    FILE *f;
+
+    snprintf(idx_path, sizeof(idx_path), "%s.idx", path);
+    f = fopen(idx_path, "r");
+    if (!f)
+        return ret;
+    if (fread(magic, sizeof(magic), 1, f) != 1 || memcmp(magic, CAPTURE_INDEX_MAGIC, sizeof(magic)) ||
+        fseeko(f, 0, SEEK_END)) {
+        fclose(f);
+        return ret;
+    }
+    /* Find the last entry with time <= since */
+    lo = 0;
+    hi = (ftello(f) - CAPTURE_MAGIC_LEN) / sizeof(entry);
+    while (lo < hi) {
+        mid = (lo + hi) / 2;
+        if (fseeko(f, CAPTURE_MAGIC_LEN + mid * sizeof(entry), SEEK_SET) ||
+            fread(&entry, sizeof(entry), 1, f) != 1)
+            break;
+        if (le64toh(entry.time_ns) <= since) {
+            ret = le64toh(entry.offset);
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    fclose(f);
+    return ret;
+}
+
+static void print_record(const struct capture_record *rec, const char *buf, size_t len,
+                         int records) {
+    time_t sec = le64toh(rec->time_ns) / 1000000000ULL;
+    char date[32];
+    struct tm tm;
+
+    if (records) {
+        localtime_r(&sec, &tm);
+        strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%S", &tm);
+        printf("# %s.%06llu pid=%u stream=%s len=%zu\n", date,
+               le64toh(rec->time_ns) % 1000000000ULL / 1000, le32toh(rec->pid),
+               rec->stream < 3 ? stream_names[rec->stream] : "?", len);
+    }
+    fwrite(buf, 1, len, stdout);
+}
+
+static const struct option long_options[] = {
+    { "since", required_argument, NULL, 1 },
+    { "until", required_argument, NULL, 2 },
+    { "pid", required_argument, NULL, 3 },
+    { "stream", required_argument, NULL, 4 },
+    { "records", no_argument, NULL, 'r' },
+    { "help", no_argument, NULL, 'h' },
+    { NULL, 0, NULL, 0 }
+};
+
+int main(int argc, char **argv) {
+    unsigned long long since = 0, until = 0, time_ns;
+    struct capture_record rec;
+    char magic[CAPTURE_MAGIC_LEN];
+    int records = 0, stream = -1;
+    size_t size = 0, len;
+    char *buf = NULL;
+    long pid = 0;
+    off_t offset;
+    FILE *f;
+    int opt;
+
+    while ((opt = getopt_long(argc, argv, "rh", long_options, NULL)) != -1) {
+        switch (opt) {
+            case 1:
+                since = parse_time(optarg);
+                if (!since)
+                    die("Invalid time: %s", optarg);
+                break;
+            case 2:
+                until = parse_time(optarg);
+                if (!until)
+                    die("Invalid time: %s", optarg);
+                break;
+            case 3:
+                pid = atol(optarg);
+                if (pid <= 0)
+                    die("Invalid pid: %s", optarg);
+                break;
+            case 4:
+                stream = parse_stream(optarg);
+                break;
+            case 'r':
+                records = 1;
+                break;
+            case 'h':
+                usage();
+                exit(0);
+            default:
+                usage();
+                exit(1);
+        }
+    }
+    if (optind != argc - 1) {
+        usage();
+        exit(1);
+    }
+
+    f = fopen(argv[optind], "r");
+    if (!f)
+        die("Cannot open %s: %s", argv[optind], strerror(errno));
+    if (fread(magic, sizeof(magic), 1, f) != 1 || memcmp(magic, CAPTURE_MAGIC, sizeof(magic)))
+        die("%s is not a capture store", argv[optind]);
+    offset = since ? index_seek(argv[optind], since) : CAPTURE_MAGIC_LEN;
+    if (fseeko(f, offset, SEEK_SET))
+        die("Cannot seek in %s: %s", argv[optind], strerror(errno));
+
+    while (fread(&rec, sizeof(rec), 1, f) == 1) {
+        if (le32toh(rec.magic) != CAPTURE_RECORD_MAGIC)
+            die("Corrupted record at offset %lld", (long long)offset);
+        len = le32toh(rec.len);
+        if (len > size) {
+            size = len;
+            buf = realloc(buf, size);
+            if (!buf)
+                die("Cannot allocate memory");
+        }
+        /* The last record may be partially written */
+        if (len && fread(buf, len, 1, f) != 1)
+            break;
+        offset += sizeof(rec) + len;
+        time_ns = le64toh(rec.time_ns);
+        if (until && time_ns > until)
+            break;
+        if (time_ns < since || (pid && le32toh(rec.pid) != pid) ||
+            (stream >= 0 && rec.stream != stream))
+            continue;
+        print_record(&rec, buf, len, records);
+    }
+    free(buf);
+    fclose(f);
+    return 0;
+}
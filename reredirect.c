@@ -27,27 +27,147 @@
 #include <stdio.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <limits.h>
 #include <linux/limits.h>
+#include <pthread.h>
+#include <time.h>
+#include <getopt.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <zlib.h>
 #include "reredirect.h"
+#include "librereredirect.h"
 
-static int verbose = 0;
+static void log_stderr(void *arg, int level, const char *msg) {
+    fprintf(stderr, "%s%s\n", level == RR_LOG_DEBUG ? "[+] " : "[-] ", msg);
+}
+
+/* Messages of the library (and of relay mode) for all our threads */
+static struct rr_options log_opts = { .log = log_stderr, .log_level = RR_LOG_ERROR };
+
+struct target {
+    pid_t pid;
+    int err;
+    int orig_fd[3];
+    int *extra_fd;      /* Saved fds of extras */
+    double latency;
+    int seized;
+    struct ptrace_stats stats;
+};
+
+static int no_restore = 0;
+static int stub = 0;
+static int stats_json = 0;
+static int relay_mode = 0;
+static unsigned long long pipe_size = 0;
+static int send_mode = 0;
+/* 1 to redirect through the agent, 2 to stop it */
+static int agent_mode = 0;
+static int send_fds[3] = { -1, -1, -1 };
+/* Open options of stdin, stdout and stderr files */
+static struct {
+    int flags;
+    int mode;
+    unsigned long long prealloc;
+} open_opts[3];
+static struct relay_options relay_opts;
+static int feed_mode = 0;
+static struct feed_options feed_opts;
+static const char *files[3];
+static int fds[3] = { -1, -1, -1 };
+/* Other fds given with -F */
+static struct extra {
+    int fd;
+    const char *file;
+    int dup_fd;
+    int send_fd;
+} *extras;
+static int nextras;
+
+static struct target *targets;
+static int ntargets;
+static int next_target;
 
 static void usage(void) {
     char *me = program_invocation_short_name;
-    fprintf(stderr, "Usage: %s [-m FILE|-o FILE|-e FILE|-O FD|-E FD] [-N] [-d] PID\n", me);
+    fprintf(stderr, "Usage: %s [-m FILE|-o FILE|-e FILE|-O FD|-E FD] [-F N=FILE]... [-N] [-S] [-j N] [-P FILE] [-d] PID...\n", me);
     fprintf(stderr, "%s redirect outputs of a running process to a file.\n", me);
-    fprintf(stderr, "  PID      Process to reattach\n");
+    fprintf(stderr, "  PID      Process to reattach. Several processes can be specified.\n");
     fprintf(stderr, "  -o FILE  File to redirect stdout. \n");
     fprintf(stderr, "  -e FILE  File to redirect stderr.\n");
     fprintf(stderr, "  -i FILE  File to redirect stdin.\n");
     fprintf(stderr, "  -m FILE  Same than -o FILE -e FILE.\n");
+    fprintf(stderr, "           FILE can be unix:PATH to connect to a unix stream socket.\n");
     fprintf(stderr, "  -O FD    Redirect stdout to this file descriptor. Mainly used to restore\n");
     fprintf(stderr, "           process outputs.\n");
     fprintf(stderr, "  -E FD    Redirect stderr to this file descriptor. Mainly used to restore\n");
     fprintf(stderr, "           process outputs.\n");
     fprintf(stderr, "  -I FD    Redirect stdin to this file descriptor. Mainly used to restore\n");
     fprintf(stderr, "           process input.\n");
+    fprintf(stderr, "  -F N=FILE\n");
+    fprintf(stderr, "           File to redirect fd N. Can be repeated. All fds are redirected\n");
+    fprintf(stderr, "           while PID is stopped once.\n");
+    fprintf(stderr, "  -F N=@FD Redirect fd N to this file descriptor. Mainly used to restore.\n");
     fprintf(stderr, "  -N       Do not save previous stream.\n");
+    fprintf(stderr, "  --relay  Relay outputs of PID to outputs of this command (or to files\n");
+    fprintf(stderr, "           given with -o, -e or -m) until it is interrupted or PID exits.\n");
+    fprintf(stderr, "           Then, PID outputs are restored.\n");
+    fprintf(stderr, "  --rotate-size=SIZE\n");
+    fprintf(stderr, "           With --relay, rotate files when they reach SIZE bytes (K, M and G\n");
+    fprintf(stderr, "           suffixes are accepted).\n");
+    fprintf(stderr, "  --rotate-time=SECONDS\n");
+    fprintf(stderr, "           With --relay, rotate files every SECONDS. SIGHUP also rotates files.\n");
+    fprintf(stderr, "  --rotate-compress=PROG\n");
+    fprintf(stderr, "           Run PROG FILE in background on each rotated file (e.g. gzip).\n");
+    fprintf(stderr, "  --ring=SIZE\n");
+    fprintf(stderr, "           With --relay, only keep last SIZE bytes of each output in memory\n");
+    fprintf(stderr, "           and write them on SIGUSR1 or on exit. PID never waits for us.\n");
+    fprintf(stderr, "  --gzip[=LEVEL]\n");
+    fprintf(stderr, "           With --relay, compress outputs in gzip format.\n");
+    fprintf(stderr, "  --gzip-threads=N\n");
+    fprintf(stderr, "           Number of compression threads. Default to the number of CPUs.\n");
+    fprintf(stderr, "  --timestamps[=wall|mono]\n");
+    fprintf(stderr, "           With --relay, start each line with the wall clock (default) or\n");
+    fprintf(stderr, "           monotonic time.\n");
+    fprintf(stderr, "  --prefix With --relay, start each line with [PID:out] or [PID:err].\n");
+    fprintf(stderr, "  --strip-ansi\n");
+    fprintf(stderr, "           With --relay, remove ANSI escape sequences (colours...).\n");
+    fprintf(stderr, "  --capture=FILE\n");
+    fprintf(stderr, "           With --relay, append outputs as timestamped records to the\n");
+    fprintf(stderr, "           capture store FILE (and its index FILE.idx). Several processes\n");
+    fprintf(stderr, "           can share a store. Read it with reredirect-cat.\n");
+    fprintf(stderr, "  --uring  With --relay, write files with io_uring if the kernel allows it.\n");
+    fprintf(stderr, "  --uring-direct\n");
+    fprintf(stderr, "           With --uring, bypass the page cache (O_DIRECT).\n");
+    fprintf(stderr, "  --uring-fsync=SIZE\n");
+    fprintf(stderr, "           With --uring, sync files to disk every SIZE bytes.\n");
+    fprintf(stderr, "  --feed   Stream FILE given with -i to stdin of PID through a pipe, then\n");
+    fprintf(stderr, "           restore stdin once PID has read everything. FILE can be '-' for\n");
+    fprintf(stderr, "           our own stdin or unix:PATH. Progress is printed on SIGUSR1.\n");
+    fprintf(stderr, "  --feed-rate=SIZE\n");
+    fprintf(stderr, "           With --feed, write at most SIZE bytes per second.\n");
+    fprintf(stderr, "  --feed-lines=N\n");
+    fprintf(stderr, "           With --feed, write at most N lines per second.\n");
+    fprintf(stderr, "  --open=[in:|out:|err:]OPT[,OPT...]\n");
+    fprintf(stderr, "           Options used to open FILE in PID: append, trunc, nonblock,\n");
+    fprintf(stderr, "           cloexec, mode=OCTAL and prealloc=SIZE. Apply to out and err\n");
+    fprintf(stderr, "           unless one is specified.\n");
+    fprintf(stderr, "  --send   Open FILE here and pass it to PID through a unix socket.\n");
+    fprintf(stderr, "           FILE can be fd:N to pass our own fd N. Any kind of fd can be\n");
+    fprintf(stderr, "           passed, even if PID cannot reach the file.\n");
+    fprintf(stderr, "  --agent  Install a persistent agent in PID on first use and redirect\n");
+    fprintf(stderr, "           through it. Next redirections of PID (and restore) do not stop\n");
+    fprintf(stderr, "           it. Implies --send. --agent=stop stops the agent.\n");
+    fprintf(stderr, "  --pipe-size=SIZE\n");
+    fprintf(stderr, "           If a FILE is a named pipe (or with --relay), set its capacity to\n");
+    fprintf(stderr, "           SIZE bytes to absorb bursts of output.\n");
+    fprintf(stderr, "  --stats=json\n");
+    fprintf(stderr, "           Print timings and ptrace counters as JSON on stderr.\n");
+    fprintf(stderr, "  -S       Run the whole redirection in the process with a single resume.\n");
+    fprintf(stderr, "           Fall back to normal mode if it is not possible.\n");
+    fprintf(stderr, "  -P FILE  Read list of processes to reattach from FILE ('-' for stdin).\n");
+    fprintf(stderr, "  -j N     Number of processes to reattach in parallel. Default to the\n");
+    fprintf(stderr, "           number of CPUs.\n");
     fprintf(stderr, "\n");
     fprintf(stderr, "Notice you can redirect to another program using name pipe. For example:\n");
     fprintf(stderr, "   mkfifo /tmp/fifo\n");
@@ -62,24 +182,6 @@ static void _debug(const char *pfx, const char *msg, va_list ap) {
     fprintf(stderr, "\n");
 }
 
-void debug(const char *msg, ...) {
-    va_list ap;
-
-    if (!verbose)
-        return;
-
-    va_start(ap, msg);
-    _debug("[+] ", msg, ap);
-    va_end(ap);
-}
-
-void error(const char *msg, ...) {
-    va_list ap;
-    va_start(ap, msg);
-    _debug("[-] ", msg, ap);
-    va_end(ap);
-}
-
 void die(const char *msg, ...) {
     va_list ap;
     va_start(ap, msg);
@@ -118,69 +220,487 @@ static void check_yama_ptrace_scope(void) {
     fprintf(stderr, "For more information, see /etc/sysctl.d/10-ptrace.conf\n");
 }
 
+static void add_target(pid_t pid) {
+    if (pid <= 0)
+        usage_die("Invalid pid\n");
+    targets = realloc(targets, (ntargets + 1) * sizeof(*targets));
+    if (!targets)
+        die("Cannot allocate memory");
+    memset(&targets[ntargets], 0, sizeof(*targets));
+    targets[ntargets].pid = pid;
+    ntargets++;
+}
+
+static void read_targets(const char *file) {
+    FILE *f = stdin;
+    long pid;
+
+    if (strcmp(file, "-")) {
+        f = fopen(file, "r");
+        if (!f)
+            die("Cannot open %s: %s", file, strerror(errno));
+    }
+    while (fscanf(f, "%ld", &pid) == 1)
+        add_target(pid);
+    if (!feof(f))
+        die("Invalid pid in %s", file);
+    if (f != stdin)
+        fclose(f);
+}
+
+static int redirect(struct target *t) {
+    struct ptrace_child child;
+    struct child_redirect redirs[3 + nextras];
+    int nredirs = 0, nstd;
+    int err;
+    int i;
+
+    for (i = 0; i < 3; i++) {
+        t->orig_fd[i] = -1;
+        if (send_fds[i] >= 0)
+            redirs[nredirs++] = (struct child_redirect){
+                i, NULL, send_fds[i], -1, 0, open_opts[i].flags, 0, 0, 1
+            };
+        else if (files[i] || fds[i] >= 0)
+            redirs[nredirs++] = (struct child_redirect){
+                i, files[i], fds[i], -1, pipe_size,
+                open_opts[i].flags, open_opts[i].mode, open_opts[i].prealloc
+            };
+    }
+    /* Extras use open options of stdout */
+    nstd = nredirs;
+    for (i = 0; i < nextras; i++) {
+        if (extras[i].send_fd >= 0)
+            redirs[nredirs++] = (struct child_redirect){
+                extras[i].fd, NULL, extras[i].send_fd, -1, 0, open_opts[1].flags, 0, 0, 1
+            };
+        else
+            redirs[nredirs++] = (struct child_redirect){
+                extras[i].fd, extras[i].file, extras[i].dup_fd, -1, pipe_size,
+                open_opts[1].flags, open_opts[1].mode, open_opts[1].prealloc
+            };
+    }
+    t->extra_fd = calloc(nextras + 1, sizeof(*t->extra_fd));
+    if (!t->extra_fd)
+        return ENOMEM;
+
+    if (agent_mode)
+        err = agent_redirect(t->pid, &child, redirs, nredirs, !no_restore);
+    else
+        err = child_redirect(t->pid, &child, redirs, nredirs, !no_restore, stub);
+    t->seized = child.seized;
+    t->stats = child.stats;
+    if (err)
+        return err;
+    for (i = 0; i < nredirs; i++) {
+        if (i < nstd)
+            t->orig_fd[redirs[i].orig_fd] = redirs[i].save_fd;
+        else
+            t->extra_fd[i - nstd] = redirs[i].save_fd;
+        if (redirs[i].file && redirs[i].pipe_size && redirs[i].pipe_size < pipe_size)
+            error("Pipe size of fd %d of %d is %d instead of %llu", redirs[i].orig_fd,
+                  t->pid, redirs[i].pipe_size, pipe_size);
+    }
+    return 0;
+}
+
+static void print_json_time(const char *name, const struct ptrace_stats *stats,
+                            const struct timespec *ts) {
+    if (ts->tv_sec || ts->tv_nsec)
+        fprintf(stderr, "\"%s\":%.3f,", name, ptrace_elapsed_ms(&stats->attach, ts));
+    else
+        fprintf(stderr, "\"%s\":null,", name);
+}
+
+/* Timestamps are in milliseconds since attach */
+static void print_stats_json(void) {
+    const struct ptrace_stats *stats;
+    const struct ptrace_syscall_stat *sc;
+    const char *sep;
+    int i, j;
+
+    fprintf(stderr, "{\"targets\":[");
+    for (i = 0; i < ntargets; i++) {
+        stats = &targets[i].stats;
+        fprintf(stderr, "%s{\"pid\":%d,", i ? "," : "", targets[i].pid);
+        if (targets[i].err)
+            fprintf(stderr, "\"error\":\"%s\",", strerror(targets[i].err));
+        else
+            fprintf(stderr, "\"error\":null,");
+        fprintf(stderr, "\"attach\":\"%s\",", targets[i].seized ? "seize" : "attach");
+        fprintf(stderr, "\"latency_ms\":%.3f,", targets[i].latency);
+        print_json_time("first_stop_ms", stats, &stats->first_stop);
+        print_json_time("at_syscall_ms", stats, &stats->at_syscall);
+        print_json_time("detach_ms", stats, &stats->detach);
+        if (stats->detach.tv_sec && stats->first_stop.tv_sec)
+            fprintf(stderr, "\"paused_ms\":%.3f,",
+                    ptrace_elapsed_ms(&stats->first_stop, &stats->detach));
+        else
+            fprintf(stderr, "\"paused_ms\":null,");
+        fprintf(stderr, "\"waits\":%lu,\"vm_copies\":%lu,", stats->waits, stats->vm_copies);
+        fprintf(stderr, "\"requests\":{");
+        sep = "";
+        for (j = 0; j < PTRACE_STAT_REQUESTS; j++) {
+            if (!stats->requests[j])
+                continue;
+            fprintf(stderr, "%s\"%s\":%lu", sep, ptrace_stat_request_name(j), stats->requests[j]);
+            sep = ",";
+        }
+        fprintf(stderr, "},\"syscalls\":[");
+        for (j = 0; j < stats->nsyscalls; j++) {
+            sc = &stats->syscalls[j];
+            fprintf(stderr, "%s{\"nr\":%ld,\"count\":%d,\"start_ms\":%.3f,\"duration_ms\":%.3f}",
+                    j ? "," : "", sc->nr, sc->count,
+                    ptrace_elapsed_ms(&stats->attach, &sc->start),
+                    ptrace_elapsed_ms(&sc->start, &sc->end));
+        }
+        /* Syscalls beyond the list above */
+        fprintf(stderr, "],\"other_syscalls\":{\"count\":%d,\"duration_ms\":%.3f}}",
+                stats->other.count, stats->other_ms);
+    }
+    fprintf(stderr, "]}\n");
+}
+
+static void *worker(void *arg) {
+    struct timespec start, end;
+    struct target *t;
+    int i;
+
+    rr_set_log(&log_opts);
+    while ((i = __atomic_fetch_add(&next_target, 1, __ATOMIC_RELAXED)) < ntargets) {
+        t = &targets[i];
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        t->err = redirect(t);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        t->latency = (end.tv_sec - start.tv_sec) * 1e3 +
+                     (end.tv_nsec - start.tv_nsec) / 1e6;
+    }
+    return NULL;
+}
+
+/* Parse a size with an optional K, M or G suffix. Return 0 on error. */
+static unsigned long long parse_size(const char *str) {
+    unsigned long long val;
+    char *end;
+
+    val = strtoull(str, &end, 10);
+    switch (*end) {
+        case 'G': case 'g':
+            val <<= 10;
+            /* fallthrough */
+        case 'M': case 'm':
+            val <<= 10;
+            /* fallthrough */
+        case 'K': case 'k':
+            val <<= 10;
+            end++;
+            break;
+    }
+    return *end ? 0 : val;
+}
+
+/*
+ * Open file to send it to the targets. "fd:N" is our own fd N and
+ * "unix:PATH" a unix socket. Open options and pipe size are applied here.
+ */
+static int open_send(const char *file, int stream) {
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    int fd;
+
+    if (!strncmp(file, "fd:", 3)) {
+        fd = atoi(file + 3);
+        if (fcntl(fd, F_GETFD) < 0)
+            die("Invalid fd %s: %s", file, strerror(errno));
+        return fd;
+    }
+    if (!strncmp(file, "unix:", 5)) {
+        snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", file + 5);
+        fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (fd < 0 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)))
+            die("Cannot connect to %s: %s", file + 5, strerror(errno));
+        return fd;
+    }
+    fd = open(file, O_RDWR | O_CREAT | O_CLOEXEC | (open_opts[stream].flags & ~O_CLOEXEC),
+              open_opts[stream].mode ? open_opts[stream].mode : 0666);
+    if (fd < 0)
+        die("Cannot open %s: %s", file, strerror(errno));
+    if (pipe_size && fcntl(fd, F_SETPIPE_SZ, (int)pipe_size) < 0 && errno != EBADF)
+        error("Unable to set pipe size of %s: %s", file, strerror(errno));
+    if (open_opts[stream].prealloc &&
+        fallocate(fd, FALLOC_FL_KEEP_SIZE, lseek(fd, 0, SEEK_END), open_opts[stream].prealloc))
+        error("Unable to preallocate %s: %s", file, strerror(errno));
+    return fd;
+}
+
+/* Parse N=FILE or N=@FD of -F */
+static void parse_extra(const char *arg) {
+    const char *val;
+    char *end;
+    long fd;
+    int i;
+
+    fd = strtol(arg, &end, 10);
+    if (end == arg || *end != '=' || fd < 0 || fd > INT_MAX)
+        usage_die("Invalid redirection: %s\n", arg);
+    val = end + 1;
+    if (fd <= 2) {
+        if (files[fd] || fds[fd] >= 0)
+            usage_die("fd %ld is redirected twice\n", fd);
+        if (*val == '@')
+            fds[fd] = atoi(val + 1);
+        else
+            files[fd] = val;
+        return;
+    }
+    for (i = 0; i < nextras; i++)
+        if (extras[i].fd == fd)
+            usage_die("fd %ld is redirected twice\n", fd);
+    extras = realloc(extras, (nextras + 1) * sizeof(*extras));
+    if (!extras)
+        die("Cannot allocate memory");
+    extras[nextras].fd = fd;
+    extras[nextras].file = *val == '@' ? NULL : val;
+    extras[nextras].dup_fd = *val == '@' ? atoi(val + 1) : -1;
+    extras[nextras].send_fd = -1;
+    nextras++;
+}
+
+/*
+ * Parse [in:|out:|err:]OPT[,OPT...] where OPT is append, trunc, nonblock,
+ * cloexec, mode=OCTAL or prealloc=SIZE. Without a stream, OPT applies to
+ * out and err: an input file must not be truncated.
+ */
+static void parse_open(char *arg) {
+    static const char *streams[] = { "in:", "out:", "err:" };
+    int first = 1, last = 2;
+    char *opt, *val;
+    int i;
+
+    for (i = 0; i < 3; i++) {
+        if (!strncmp(arg, streams[i], strlen(streams[i]))) {
+            first = last = i;
+            arg += strlen(streams[i]);
+        }
+    }
+    for (opt = strtok(arg, ","); opt; opt = strtok(NULL, ",")) {
+        val = strchr(opt, '=');
+        if (val)
+            *val++ = '\0';
+        if (!first && (!strcmp(opt, "append") || !strcmp(opt, "trunc") ||
+                       !strcmp(opt, "prealloc")))
+            usage_die("Open option %s does not apply to in:\n", opt);
+        for (i = first; i <= last; i++) {
+            if (!strcmp(opt, "append") && !val)
+                open_opts[i].flags |= O_APPEND;
+            else if (!strcmp(opt, "trunc") && !val)
+                open_opts[i].flags |= O_TRUNC;
+            else if (!strcmp(opt, "nonblock") && !val)
+                open_opts[i].flags |= O_NONBLOCK;
+            else if (!strcmp(opt, "cloexec") && !val)
+                open_opts[i].flags |= O_CLOEXEC;
+            else if (!strcmp(opt, "mode") && val)
+                open_opts[i].mode = strtol(val, NULL, 8);
+            else if (!strcmp(opt, "prealloc") && val && (open_opts[i].prealloc = parse_size(val)))
+                ;
+            else
+                usage_die("Invalid open option: %s\n", opt);
+        }
+    }
+}
+
+static const struct option long_options[] = {
+    { "stats", required_argument, NULL, 1 },
+    { "relay", no_argument, NULL, 2 },
+    { "rotate-size", required_argument, NULL, 3 },
+    { "rotate-time", required_argument, NULL, 4 },
+    { "rotate-compress", required_argument, NULL, 5 },
+    { "gzip", optional_argument, NULL, 6 },
+    { "gzip-threads", required_argument, NULL, 7 },
+    { "ring", required_argument, NULL, 8 },
+    { "pipe-size", required_argument, NULL, 9 },
+    { "open", required_argument, NULL, 10 },
+    { "send", no_argument, NULL, 11 },
+    { "agent", optional_argument, NULL, 12 },
+    { "timestamps", optional_argument, NULL, 13 },
+    { "prefix", no_argument, NULL, 14 },
+    { "strip-ansi", no_argument, NULL, 15 },
+    { "capture", required_argument, NULL, 16 },
+    { "uring", no_argument, NULL, 17 },
+    { "uring-direct", no_argument, NULL, 18 },
+    { "uring-fsync", required_argument, NULL, 19 },
+    { "feed", no_argument, NULL, 20 },
+    { "feed-rate", required_argument, NULL, 21 },
+    { "feed-lines", required_argument, NULL, 22 },
+    { NULL, 0, NULL, 0 }
+};
+
 int main(int argc, char **argv) {
-    int no_restore = 0;
-    int fde = -1;
-    int fdo = -1;
-    int fdi = -1;
-    int fde_orig = -1;
-    int fdo_orig = -1;
-    int fdi_orig = -1;
-    const char *filei = NULL;
-    const char *fileo = NULL;
-    const char *filee = NULL;
-    pid_t pid;
+    long njobs = sysconf(_SC_NPROCESSORS_ONLN);
+    pthread_t *threads;
+    int failed = 0;
     int opt;
-    int err;
-    unsigned long scratch_page = (unsigned long) -1;
-    struct ptrace_child child;
+    int i, j;
 
-    while ((opt = getopt(argc, argv, "m:i:o:e:I:O:E:s:dNvVh")) != -1) {
+    rr_set_log(&log_opts);
+    while ((opt = getopt_long(argc, argv, "m:i:o:e:I:O:E:F:P:j:s:dNSvVh",
+                              long_options, NULL)) != -1) {
         switch (opt) {
+            case 1:
+                if (strcmp(optarg, "json"))
+                    usage_die("Unknown stats format: %s\n", optarg);
+                stats_json = 1;
+                break;
+            case 2:
+                relay_mode = 1;
+                break;
+            case 3:
+                relay_opts.rotate_size = parse_size(optarg);
+                if (!relay_opts.rotate_size)
+                    usage_die("Invalid size: %s\n", optarg);
+                break;
+            case 4:
+                relay_opts.rotate_time = atoi(optarg);
+                if (relay_opts.rotate_time <= 0)
+                    usage_die("Invalid time: %s\n", optarg);
+                break;
+            case 5:
+                relay_opts.compress = optarg;
+                break;
+            case 6:
+                relay_opts.gzip_level = optarg ? atoi(optarg) : Z_DEFAULT_COMPRESSION;
+                if (relay_opts.gzip_level < 1 || relay_opts.gzip_level > 9)
+                    if (relay_opts.gzip_level != Z_DEFAULT_COMPRESSION)
+                        usage_die("Invalid compression level: %s\n", optarg);
+                break;
+            case 7:
+                relay_opts.gzip_threads = atoi(optarg);
+                if (relay_opts.gzip_threads <= 0)
+                    usage_die("Invalid number of threads\n");
+                break;
+            case 8:
+                relay_opts.ring_size = parse_size(optarg);
+                if (!relay_opts.ring_size)
+                    usage_die("Invalid size: %s\n", optarg);
+                break;
+            case 9:
+                pipe_size = parse_size(optarg);
+                /* F_SETPIPE_SZ takes an int */
+                if (!pipe_size || pipe_size > INT_MAX)
+                    usage_die("Invalid size: %s\n", optarg);
+                break;
+            case 10:
+                parse_open(optarg);
+                break;
+            case 11:
+                send_mode = 1;
+                break;
+            case 12:
+                if (optarg && strcmp(optarg, "stop"))
+                    usage_die("Unknown agent command: %s\n", optarg);
+                agent_mode = optarg ? 2 : 1;
+                send_mode = 1;
+                break;
+            case 13:
+                relay_opts.line_flags &= ~(LINE_TS_WALL | LINE_TS_MONO);
+                if (!optarg || !strcmp(optarg, "wall"))
+                    relay_opts.line_flags |= LINE_TS_WALL;
+                else if (!strcmp(optarg, "mono"))
+                    relay_opts.line_flags |= LINE_TS_MONO;
+                else
+                    usage_die("Unknown clock: %s\n", optarg);
+                break;
+            case 14:
+                relay_opts.prefix = 1;
+                break;
+            case 15:
+                relay_opts.line_flags |= LINE_STRIP_ANSI;
+                break;
+            case 16:
+                relay_opts.capture = optarg;
+                break;
+            case 17:
+                relay_opts.uring = 1;
+                break;
+            case 18:
+                relay_opts.uring = relay_opts.uring_direct = 1;
+                break;
+            case 19:
+                relay_opts.uring = 1;
+                relay_opts.uring_fsync = parse_size(optarg);
+                if (!relay_opts.uring_fsync)
+                    usage_die("Invalid size: %s\n", optarg);
+                break;
+            case 20:
+                feed_mode = 1;
+                break;
+            case 21:
+                feed_opts.rate = parse_size(optarg);
+                if (!feed_opts.rate)
+                    usage_die("Invalid size: %s\n", optarg);
+                break;
+            case 22:
+                feed_opts.lines = strtoull(optarg, NULL, 10);
+                if (!feed_opts.lines)
+                    usage_die("Invalid number of lines: %s\n", optarg);
+                break;
             case 'I':
-                if (filei || fdi >= 0)
+                if (files[0] || fds[0] >= 0)
                     usage_die("-i and -I are exclusive\n");
-                fdi = atoi(optarg);
+                fds[0] = atoi(optarg);
                 break;
             case 'O':
-                if (fileo || fdo >= 0)
+                if (files[1] || fds[1] >= 0)
                     usage_die("-m, -o and -O are exclusive\n");
-                fdo = atoi(optarg);
+                fds[1] = atoi(optarg);
                 break;
             case 'E':
-                if (filee || fde >= 0)
+                if (files[2] || fds[2] >= 0)
                     usage_die("-m, -e and -E are exclusive\n");
-                fde = atoi(optarg);
+                fds[2] = atoi(optarg);
                 break;
             case 'i':
-                if (filei || fdi >= 0)
+                if (files[0] || fds[0] >= 0)
                     usage_die("-i and -I are exclusive\n");
-                filei = optarg;
+                files[0] = optarg;
                 break;
             case 'o':
-                if (fileo || fdo >= 0)
+                if (files[1] || fds[1] >= 0)
                     usage_die("-m, -o and -O are exclusive\n");
-                fileo = optarg;
+                files[1] = optarg;
                 break;
             case 'e':
-                if (filee || fde >= 0)
+                if (files[2] || fds[2] >= 0)
                     usage_die("-m, -e and -E are exclusive\n");
-                filee = optarg;
+                files[2] = optarg;
                 break;
             case 'm':
-                if (filee || fde >= 0 || fileo || fdo >= 0)
+                if (files[2] || fds[2] >= 0 || files[1] || fds[1] >= 0)
                     usage_die("-m is exclusive with  -o, -e, -O and -E\n");
-                fileo = filee = optarg;
+                files[1] = files[2] = optarg;
+                break;
+            case 'F':
+                parse_extra(optarg);
+                break;
+            case 'P':
+                read_targets(optarg);
+                break;
+            case 'j':
+                njobs = atoi(optarg);
+                if (njobs <= 0)
+                    usage_die("Invalid number of jobs\n");
                 break;
             case 'N':
                 no_restore = 1;
                 break;
+            case 'S':
+                stub = 1;
+                break;
             case 'h':
                 usage();
                 exit(0);
                 break;
             case 'v':
-                verbose = 1;
+                log_opts.log_level = RR_LOG_DEBUG;
                 break;
             case 'V':
                 printf("This is reredirect version %s.\n", REREDIRECT_VERSION);
@@ -192,35 +712,149 @@ int main(int argc, char **argv) {
         }
     }
 
-    if (optind >= argc)
+    for (i = optind; i < argc; i++)
+        add_target(atoi(argv[i]));
+    if (!ntargets)
         usage_die("No pid specified to attach\n");
 
-    pid = atoi(argv[optind]);
-    err = child_attach(pid, &child, &scratch_page);
-    if (err) {
-        fprintf(stderr, "Unable to attach to pid %d: %s\n", pid, strerror(err));
-        if (err == EPERM)
+    if ((relay_opts.rotate_size || relay_opts.rotate_time || relay_opts.compress) &&
+        (!relay_mode || (!files[1] && !files[2])))
+        usage_die("--rotate-* options need --relay and -o, -e or -m\n");
+    if ((relay_opts.gzip_level || relay_opts.gzip_threads) && !relay_mode)
+        usage_die("--gzip needs --relay\n");
+    if (relay_opts.ring_size && !relay_mode)
+        usage_die("--ring needs --relay\n");
+    if ((relay_opts.line_flags || relay_opts.prefix) && !relay_mode)
+        usage_die("--timestamps, --prefix and --strip-ansi need --relay\n");
+    if (relay_opts.capture && (!relay_mode || files[1] || files[2] || relay_opts.gzip_level ||
+                               relay_opts.ring_size || relay_opts.rotate_size ||
+                               relay_opts.rotate_time))
+        usage_die("--capture needs --relay and is exclusive with -o, -e, -m, --gzip, --ring\n"
+                  "and --rotate-*\n");
+    if (relay_opts.uring && (!relay_mode || (!files[1] && !files[2]) || relay_opts.gzip_level))
+        usage_die("--uring options need --relay and -o, -e or -m and are exclusive with --gzip\n");
+    if (!relay_opts.gzip_threads)
+        relay_opts.gzip_threads = sysconf(_SC_NPROCESSORS_ONLN);
+    if (agent_mode && relay_mode)
+        usage_die("--agent is not supported with --relay\n");
+    if ((feed_opts.rate || feed_opts.lines) && !feed_mode)
+        usage_die("--feed-rate and --feed-lines need --feed\n");
+    if (agent_mode == 2) {
+        for (i = 0; i < ntargets; i++) {
+            targets[i].err = agent_stop(targets[i].pid);
+            if (!targets[i].err)
+                continue;
+            fprintf(stderr, "Unable to stop agent of pid %d: %s\n", targets[i].pid,
+                    strerror(targets[i].err));
+            failed++;
+        }
+        return failed ? 1 : 0;
+    }
+    if (relay_mode) {
+        for (i = 0; i < 3; i++)
+            if (open_opts[i].flags || open_opts[i].mode || open_opts[i].prealloc)
+                usage_die("--open is not supported with --relay\n");
+        if (files[0] || fds[0] >= 0 || fds[1] >= 0 || fds[2] >= 0 || nextras)
+            usage_die("--relay is exclusive with -i, -I, -O, -E and -F\n");
+        if (ntargets != 1)
+            usage_die("--relay only accepts one pid\n");
+        relay_opts.files[0] = files[1];
+        relay_opts.files[1] = files[2];
+        relay_opts.stub = stub;
+        relay_opts.pipe_size = pipe_size;
+        relay_opts.send = send_mode;
+        targets[0].err = relay(targets[0].pid, &relay_opts);
+        if (targets[0].err) {
+            fprintf(stderr, "Unable to relay pid %d: %s\n", targets[0].pid, strerror(targets[0].err));
+            if (targets[0].err == EPERM)
+                check_yama_ptrace_scope();
+            return 1;
+        }
+        return 0;
+    }
+    if (feed_mode) {
+        for (i = 0; i < 3; i++)
+            if (open_opts[i].flags || open_opts[i].mode || open_opts[i].prealloc)
+                usage_die("--open is not supported with --feed\n");
+        if (!files[0])
+            usage_die("--feed needs -i\n");
+        if (relay_mode || agent_mode || files[1] || files[2] || fds[1] >= 0 || fds[2] >= 0 ||
+            nextras)
+            usage_die("--feed is exclusive with --relay, --agent, -o, -e, -m, -O, -E and -F\n");
+        if (ntargets != 1)
+            usage_die("--feed only accepts one pid\n");
+        feed_opts.source = files[0];
+        feed_opts.stub = stub;
+        feed_opts.pipe_size = pipe_size;
+        feed_opts.send = send_mode;
+        targets[0].err = feed(targets[0].pid, &feed_opts);
+        if (targets[0].err) {
+            fprintf(stderr, "Unable to feed pid %d: %s\n", targets[0].pid, strerror(targets[0].err));
+            if (targets[0].err == EPERM)
+                check_yama_ptrace_scope();
+            return 1;
+        }
+        return 0;
+    }
+
+    /* All targets share the same open file (and offset) */
+    for (i = 0; send_mode && i < 3; i++) {
+        if (i == 2 && files[2] == files[1])
+            send_fds[2] = send_fds[1];
+        else if (files[i])
+            send_fds[i] = open_send(files[i], i);
+    }
+    for (i = 0; send_mode && i < nextras; i++)
+        if (extras[i].file)
+            extras[i].send_fd = open_send(extras[i].file, 1);
+
+    if (njobs > ntargets)
+        njobs = ntargets;
+    threads = calloc(njobs, sizeof(*threads));
+    if (!threads)
+        die("Cannot allocate memory");
+    for (i = 1; i < njobs; i++)
+        if (pthread_create(&threads[i], NULL, worker, NULL))
+            die("Cannot create thread");
+    worker(NULL);
+    for (i = 1; i < njobs; i++)
+        pthread_join(threads[i], NULL);
+    free(threads);
+
+    for (i = 0; i < ntargets; i++) {
+        if (!targets[i].err)
+            continue;
+        fprintf(stderr, "Unable to attach to pid %d: %s\n", targets[i].pid, strerror(targets[i].err));
+        if (targets[i].err == EPERM && !failed)
             check_yama_ptrace_scope();
-        exit(1);
-    }
-    if (filei)
-        fdi = child_open(&child, scratch_page, filei);
-    if (fileo)
-        fdo = child_open(&child, scratch_page, fileo);
-    if (filee)
-        fde = child_open(&child, scratch_page, filee);
-    if (fdi >= 0)
-        fdi_orig = child_dup(&child, fdi, 0, !no_restore);
-    if (fdo >= 0)
-        fdo_orig = child_dup(&child, fdo, 1, !no_restore);
-    if (fde >= 0)
-        fde_orig = child_dup(&child, fde, 2, !no_restore);
-    child_detach(&child, scratch_page);
-
-    if (!no_restore) {
+        failed++;
+    }
+    if (ntargets > 1)
+        for (i = 0; i < ntargets; i++)
+            fprintf(stderr, "# %d: %s in %.3f ms\n", targets[i].pid,
+                    targets[i].err ? "failed" : "redirected", targets[i].latency);
+
+    if (stats_json)
+        print_stats_json();
+
+    if (!no_restore && failed < ntargets) {
         printf("# Previous state saved. To restore, use:\n");
-        printf("%s -N -I %d -O %d -E %d %d\n", program_invocation_name, fdi_orig, fdo_orig, fde_orig, pid);
+        for (i = 0; i < ntargets; i++) {
+            if (targets[i].err)
+                continue;
+            for (j = 0; j < nextras; j++)
+                if (targets[i].extra_fd[j] < 0)
+                    printf("# fd %d of %d was not open and cannot be restored\n",
+                           extras[j].fd, targets[i].pid);
+            printf("%s -N%s -I %d -O %d -E %d", program_invocation_name,
+                   agent_mode ? " --agent" : "", targets[i].orig_fd[0], targets[i].orig_fd[1],
+                   targets[i].orig_fd[2]);
+            for (j = 0; j < nextras; j++)
+                if (targets[i].extra_fd[j] >= 0)
+                    printf(" -F %d=@%d", extras[j].fd, targets[i].extra_fd[j]);
+            printf(" %d\n", targets[i].pid);
+        }
     }
 
-    return 0;
+    return failed ? 1 : 0;
 }
@@ -20,13 +20,235 @@
  * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
  * THE SOFTWARE.
  */
+#include <stdint.h>
+#include <sys/un.h>
 #include "ptrace.h"
 #include "version.h"
 
-int child_attach(pid_t pid, struct ptrace_child *child, child_addr_t *scratch_page);
+/*
+ * Replace orig_fd in the child with file (if not NULL) or with the fd
+ * already opened in the child. On return, save_fd is the saved copy of
+ * orig_fd, or -1, and error is 0 if orig_fd was replaced or an errno value
+ * (child_redirect() only fails if the child cannot be attached). If
+ * pipe_size is not 0 and file is a pipe, its capacity is changed and
+ * pipe_size contains the resulting capacity on return.
+ *
+ * file is opened with O_RDWR | O_CREAT | flags and mode (0666 if 0). If
+ * flags hold O_WRONLY or CHILD_O_RDONLY, file is opened with this access mode
+ * instead of O_RDWR (O_RDONLY is 0 and cannot be told apart). If prealloc is
+ * not 0, prealloc bytes are reserved after the end of the file.
+ *
+ * If send is set, fd is one of our fds. It is passed to the child with
+ * SCM_RIGHTS and, on return, fd is the received fd in the child. If file is
+ * "unix:PATH", the child connects to the unix socket PATH instead.
+ */
+#define CHILD_O_RDONLY 010000000000
+
+struct child_redirect {
+    int orig_fd;
+    const char *file;
+    int fd;
+    int save_fd;
+    int pipe_size;
+    int flags;
+    int mode;
+    unsigned long long prealloc;
+    int send;
+    int error;
+};
+
+int child_mmap(struct ptrace_child *child, child_addr_t *addr, unsigned long len, int prot);
+int child_attach(pid_t pid, struct ptrace_child *child, child_addr_t *scratch_page, int *exec);
 int child_detach(struct ptrace_child *child, child_addr_t scratch_page);
-int child_open(struct ptrace_child *child, child_addr_t scratch_page, const char *file);
-int child_dup(struct ptrace_child *child, int file_fd, int orig_fd, int save_orig);
+int child_open(struct ptrace_child *child, child_addr_t scratch_page, const char *file,
+               int flags, int mode);
+int child_dup(struct ptrace_child *child, int file_fd, int orig_fd, int save_orig, int *dup_err);
+int child_set_pipe_size(struct ptrace_child *child, int fd, int size);
+int child_fallocate(struct ptrace_child *child, int fd, unsigned long long len);
+int child_fd_flags(pid_t pid, int fd);
+int child_recv_fd(struct ptrace_child *child, child_addr_t scratch_page, int fd);
+int child_same_netns(pid_t pid);
+int child_connect_unix(struct ptrace_child *child, child_addr_t scratch_page, const char *file);
+int child_redirect(pid_t pid, struct ptrace_child *child,
+                   struct child_redirect *redirs, int n, int save_orig, int stub);
+int child_redirect_stub(struct ptrace_child *child, child_addr_t scratch_page,
+                        struct child_redirect *redirs, int n, int save_orig);
+
+/*
+ * Persistent agent installed in the target by agent_redirect(). It runs on
+ * its own thread and listens on the abstract unix socket
+ * "reredirect-agent/PID". For each agent_request, fd (or the fd passed
+ * with SCM_RIGHTS) is duplicated onto orig_fd. agent_conf is written at the
+ * beginning of the memory of the agent. Offsets of its first fields are
+ * used by the assembly entry point.
+ */
+struct agent_conf {
+    unsigned long stack;
+    long tid;
+    unsigned int addr_len;
+    struct sockaddr_un addr;
+};
+#define AGENT_CONF_STACK 0
+#define AGENT_CONF_TID 8
+
+struct agent_request {
+    int orig_fd;
+    int fd;
+    int flags;
+    int save;
+    int quit;
+};
+
+struct agent_reply {
+    int err;
+    int save_fd;
+};
+
+/* Machine code of the agent in our own memory (NULL if unsupported) */
+struct agent_code {
+    const unsigned char *start;
+    const unsigned char *end;
+    const unsigned char *entry;
+};
+extern const struct agent_code agent_code;
+
+int agent_redirect(pid_t pid, struct ptrace_child *child,
+                   struct child_redirect *redirs, int n, int save_orig);
+int agent_stop(pid_t pid);
+
+/*
+ * Options of relay mode. files are used for stdout and stderr (NULL to relay
+ * to our own outputs). Files are rotated when they reach rotate_size bytes
+ * or rotate_time seconds (0 to disable) and rotated files are passed to
+ * the compress command (if not NULL). If gzip_level is not 0, data are
+ * compressed by gzip_threads threads before being written. If ring_size
+ * is not 0, only the last ring_size bytes of each output are kept in memory
+ * and written on SIGUSR1 or on exit. If pipe_size is not 0, capacity of
+ * the relay pipes is changed. Pipes are passed to the target with
+ * SCM_RIGHTS. The target only opens them through /proc (which needs our uid)
+ * if it is in another network namespace and send is not set. line_flags
+ * (LINE_* values) enable line processing and, if prefix is set, lines start
+ * with the pid and the name of the stream. If capture is not NULL, both
+ * streams are written as records to this capture store instead of files.
+ * If uring is set, files are written with io_uring when available, with
+ * O_DIRECT if uring_direct is set and with a fdatasync every uring_fsync
+ * bytes (0 to disable).
+ */
+struct relay_options {
+    const char *files[2];
+    unsigned long long rotate_size;
+    int rotate_time;
+    const char *compress;
+    int gzip_level;
+    int gzip_threads;
+    size_t ring_size;
+    int pipe_size;
+    int send;
+    int stub;
+    int line_flags;
+    int prefix;
+    const char *capture;
+    int uring;
+    int uring_direct;
+    unsigned long long uring_fsync;
+};
+
+int relay(pid_t pid, const struct relay_options *opts);
+
+/*
+ * Options of feed mode. source is streamed to stdin of the target: a file,
+ * "-" for our own stdin or unix:PATH for a unix socket. rate and lines limit
+ * the bytes and lines written per second (0 for no limit). pipe_size, send
+ * and stub have the same meaning as in relay_options.
+ */
+struct feed_options {
+    const char *source;
+    unsigned long long rate;
+    unsigned long long lines;
+    int pipe_size;
+    int send;
+    int stub;
+};
+
+int feed(pid_t pid, const struct feed_options *opts);
+
+/*
+ * Line processing of relay mode. label (if not NULL) is written after the
+ * timestamp at the beginning of each line. Output is passed to a
+ * line_output_fn, which returns -1 on error.
+ */
+#define LINE_TS_WALL 1
+#define LINE_TS_MONO 2
+#define LINE_STRIP_ANSI 4
+
+enum { LINE_ISA_AUTO, LINE_ISA_SCALAR, LINE_ISA_SSE2, LINE_ISA_AVX2 };
+
+typedef int (*line_output_fn)(void *arg, const char *buf, size_t n);
+
+struct line_filter {
+    int flags;
+    const char *label;
+    const char *(*scan)(const char *p, const char *end, char c);
+    int bol;
+    int ansi;
+    char header[128];
+    size_t header_len;
+    char buf[64 * 1024];
+    size_t len;
+};
+
+const char *line_filter_init(struct line_filter *f, int flags, const char *label, int isa);
+int line_filter_process(struct line_filter *f, const char *in, size_t n,
+                        line_output_fn out, void *arg);
+
+/* Capture store format (see capture.c) */
+#define CAPTURE_MAGIC "RRCAP001"
+#define CAPTURE_INDEX_MAGIC "RRIDX001"
+#define CAPTURE_MAGIC_LEN 8
+/* "RRCR" */
+#define CAPTURE_RECORD_MAGIC 0x52435252
+#define CAPTURE_INDEX_EVERY (1024 * 1024)
+
+struct capture_record {
+    uint32_t magic;
+    uint32_t len;
+    uint64_t time_ns;
+    uint32_t pid;
+    uint8_t stream;
+    uint8_t pad[3];
+};
+
+struct capture_index {
+    uint64_t time_ns;
+    uint64_t offset;
+};
+
+struct capture;
+struct capture *capture_open(const char *path);
+int capture_write(struct capture *c, pid_t pid, int stream, const void *buf, size_t n);
+void capture_close(struct capture *c);
+
+struct gz_sink;
+struct gz_sink *gz_sink_new(int fd, int level, int nworkers);
+void gz_sink_write(struct gz_sink *gz, const void *buf, size_t len);
+void gz_sink_submit(struct gz_sink *gz);
+size_t gz_sink_pending(struct gz_sink *gz);
+unsigned long long gz_sink_written(struct gz_sink *gz);
+void gz_sink_flush(struct gz_sink *gz);
+void gz_sink_set_fd(struct gz_sink *gz, int fd);
+void gz_sink_free(struct gz_sink *gz);
+
+struct uring_sink;
+struct uring_sink *uring_sink_new(int fd, int direct, unsigned long long fsync_every);
+char *uring_sink_buffer(struct uring_sink *u, size_t *space);
+void uring_sink_commit(struct uring_sink *u, size_t n);
+void uring_sink_write(struct uring_sink *u, const void *data, size_t n);
+size_t uring_sink_pending(struct uring_sink *u);
+void uring_sink_submit(struct uring_sink *u);
+void uring_sink_kick(struct uring_sink *u);
+void uring_sink_flush(struct uring_sink *u);
+void uring_sink_set_fd(struct uring_sink *u, int fd);
+void uring_sink_free(struct uring_sink *u);
 
 #define __printf __attribute__((format(printf, 1, 2)))
 void __printf die(const char *msg, ...) __attribute__((noreturn));
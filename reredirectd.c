@@ -0,0 +1,780 @@
+/*
+ * Copyright (C) 2014 by Jérôme Pouiller <jezz@sysmic.org>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+/*
+ * Daemon owning redirects and relays of many processes. Requests are lines
+ * sent on a unix socket:
+ *
+ *   redirect PID [in=FILE] [out=FILE] [err=FILE] [all=FILE]
+ *   relay PID [out=FILE] [err=FILE] [all=FILE]
+ *   restore PID
+ *   status [PID]
+ *
+ * Each reply ends with a line starting with "ok" or "error". ptrace work is
+ * done by worker threads; the main thread runs an epoll loop handling
+ * clients, relay pipes and exits of targets.
+ */
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <unistd.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/un.h>
+#include "librereredirect.h"
+#include "version.h"
+
+#ifndef SYS_pidfd_open
+#define SYS_pidfd_open 434
+#endif
+
+#define MAX_LINE 4096
+#define RELAY_CHUNK (64 * 1024)
+
+/* Kind of the objects registered in epoll. Each one starts with it. */
+enum watch_kind { W_LISTEN, W_SIGNAL, W_DONE, W_CLIENT, W_STREAM, W_TARGET };
+
+struct watch {
+    enum watch_kind kind;
+};
+
+struct client {
+    enum watch_kind kind;
+    int fd;
+    unsigned long id;
+    char buf[MAX_LINE];
+    size_t len;
+    struct client *next;
+};
+
+/* Read end of a relay pipe. Target writes in the other end. */
+struct stream {
+    enum watch_kind kind;
+    struct target *t;
+    int fd;
+    int sink;
+    char *path;
+    int no_splice;
+    unsigned long long bytes;
+};
+
+struct target {
+    enum watch_kind kind;
+    pid_t pid;
+    int relay;
+    /* A job is running for this target */
+    int busy;
+    int exited;
+    int dead;
+    int pidfd;
+    struct rr_fd fds[3];
+    int nfds;
+    char *files[3];
+    struct stream streams[2];
+    struct target *next;
+};
+
+enum job_kind { JOB_REDIRECT, JOB_RESTORE };
+
+struct job {
+    enum job_kind kind;
+    struct target *t;
+    unsigned long client_id;
+    struct rr_fd fds[3];
+    int nfds;
+    int err;
+    struct rr_result res;
+    struct job *next;
+};
+
+static struct rr_options log_opts;
+static struct rr_options rr_opts;
+static int epfd;
+static int done_fd;
+static struct client *clients;
+static unsigned long next_client_id;
+static struct target *targets;
+/*
+ * Objects removed while handling a batch of events are freed after it,
+ * since other events of the batch may point to them.
+ */
+static struct target *dead_targets;
+static struct client *dead_clients;
+
+static pthread_mutex_t jobs_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t jobs_cond = PTHREAD_COND_INITIALIZER;
+static struct job *pending, *done;
+static int quit;
+
+static void log_stderr(void *arg, int level, const char *msg) {
+    fprintf(stderr, "%s%s\n", level == RR_LOG_DEBUG ? "[+] " : "[-] ", msg);
+}
+
+static void __attribute__((format(printf, 1, 2), noreturn)) die(const char *msg, ...) {
+    va_list ap;
+
+    fprintf(stderr, "[!] ");
+    va_start(ap, msg);
+    vfprintf(stderr, msg, ap);
+    va_end(ap);
+    fprintf(stderr, "\n");
+    exit(1);
+}
+
+static void usage(void) {
+    char *me = program_invocation_short_name;
+    fprintf(stderr, "Usage: %s [-s SOCKET] [-j N] [-S] [-v]\n", me);
+    fprintf(stderr, "%s manages redirections of running processes on behalf of clients.\n", me);
+    fprintf(stderr, "  -s SOCKET Listen on SOCKET. Default to /run/reredirectd.sock.\n");
+    fprintf(stderr, "  -j N      Number of threads attaching to processes. Default to the\n");
+    fprintf(stderr, "            number of CPUs.\n");
+    fprintf(stderr, "  -S        Run each redirection with a single resume when possible.\n");
+    fprintf(stderr, "  -v        Print debug output.\n");
+    fprintf(stderr, "\n");
+    fprintf(stderr, "Requests are lines sent to SOCKET:\n");
+    fprintf(stderr, "  redirect PID [in=FILE] [out=FILE] [err=FILE] [all=FILE]\n");
+    fprintf(stderr, "  relay PID [out=FILE] [err=FILE] [all=FILE]\n");
+    fprintf(stderr, "  restore PID\n");
+    fprintf(stderr, "  status [PID]\n");
+}
+
+static void watch_add(int fd, void *ptr) {
+    struct epoll_event ev = { .events = EPOLLIN, .data.ptr = ptr };
+
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev))
+        die("Cannot watch fd %d: %s", fd, strerror(errno));
+}
+
+static void __attribute__((format(printf, 2, 3))) reply(unsigned long id, const char *msg, ...) {
+    char buf[MAX_LINE];
+    struct client *c;
+    va_list ap;
+    int len;
+
+    for (c = clients; c && c->id != id; c = c->next)
+        ;
+    /* Client left before the end of its request */
+    if (!c)
+        return;
+    va_start(ap, msg);
+    len = vsnprintf(buf, sizeof(buf) - 1, msg, ap);
+    va_end(ap);
+    if (len > sizeof(buf) - 2)
+        len = sizeof(buf) - 2;
+    buf[len++] = '\n';
+    /* Replies are small: a client which does not read them is dropped */
+    if (send(c->fd, buf, len, MSG_NOSIGNAL | MSG_DONTWAIT) != len)
+        shutdown(c->fd, SHUT_RDWR);
+}
+
+/*
+ * Worker threads
+ */
+
+static void *worker(void *arg) {
+    uint64_t one = 1;
+    struct job *job;
+
+    rr_set_log(&log_opts);
+    pthread_mutex_lock(&jobs_lock);
+    for (;;) {
+        while (!pending && !quit)
+            pthread_cond_wait(&jobs_cond, &jobs_lock);
+        if (quit)
+            break;
+        job = pending;
+        pending = job->next;
+        pthread_mutex_unlock(&jobs_lock);
+
+        if (job->kind == JOB_REDIRECT) {
+            job->err = rr_redirect(job->t->pid, job->fds, job->nfds, &rr_opts, &job->res);
+            /* The target is forgotten, put back the fds that were replaced */
+            if (job->err)
+                rr_restore(job->t->pid, job->fds, job->nfds, &rr_opts, NULL);
+        } else
+            job->err = rr_restore(job->t->pid, job->fds, job->nfds, &rr_opts, &job->res);
+
+        pthread_mutex_lock(&jobs_lock);
+        job->next = done;
+        done = job;
+        if (write(done_fd, &one, sizeof(one)) != sizeof(one))
+            log_stderr(NULL, RR_LOG_ERROR, "Cannot wake up main thread");
+    }
+    pthread_mutex_unlock(&jobs_lock);
+    return NULL;
+}
+
+static void submit(struct target *t, enum job_kind kind, unsigned long client_id) {
+    struct job *job, **p;
+
+    job = calloc(1, sizeof(*job));
+    if (!job)
+        die("Cannot allocate memory");
+    job->kind = kind;
+    job->t = t;
+    job->client_id = client_id;
+    job->nfds = t->nfds;
+    memcpy(job->fds, t->fds, sizeof(job->fds));
+    t->busy = 1;
+
+    /* Keep order of requests */
+    pthread_mutex_lock(&jobs_lock);
+    for (p = &pending; *p; p = &(*p)->next)
+        ;
+    *p = job;
+    pthread_cond_signal(&jobs_cond);
+    pthread_mutex_unlock(&jobs_lock);
+}
+
+/*
+ * Targets
+ */
+
+static struct target *find_target(pid_t pid) {
+    struct target *t;
+
+    for (t = targets; t && t->pid != pid; t = t->next)
+        ;
+    return t;
+}
+
+/* Move data available in the pipe to the sink. Return 0 on EOF. */
+static int stream_relay(struct stream *s) {
+    char buf[RELAY_CHUNK];
+    ssize_t n, w, off;
+
+    for (;;) {
+        if (!s->no_splice) {
+            n = splice(s->fd, NULL, s->sink, NULL, RELAY_CHUNK, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            if (n < 0 && errno == EINVAL) {
+                s->no_splice = 1;
+                continue;
+            }
+        } else {
+            n = read(s->fd, buf, sizeof(buf));
+            for (off = 0; n > 0 && off < n; off += w) {
+                w = write(s->sink, buf + off, n - off);
+                if (w < 0) {
+                    log_stderr(NULL, RR_LOG_ERROR, "Cannot write relayed data");
+                    break;
+                }
+            }
+        }
+        if (n > 0) {
+            s->bytes += n;
+            continue;
+        }
+        if (n < 0 && errno == EINTR)
+            continue;
+        return n < 0 && errno == EAGAIN;
+    }
+}
+
+static void stream_close(struct stream *s) {
+    if (s->fd >= 0) {
+        stream_relay(s);
+        close(s->fd);
+    }
+    if (s->sink >= 0)
+        close(s->sink);
+    s->fd = s->sink = -1;
+}
+
+static void target_free(struct target *t) {
+    struct target **p;
+    int i;
+
+    for (p = &targets; *p != t; p = &(*p)->next)
+        ;
+    *p = t->next;
+    for (i = 0; i < 2; i++)
+        stream_close(&t->streams[i]);
+    if (t->pidfd >= 0)
+        close(t->pidfd);
+    t->pidfd = -1;
+    t->dead = 1;
+    t->next = dead_targets;
+    dead_targets = t;
+}
+
+static struct target *target_new(pid_t pid) {
+    struct target *t;
+    int i;
+
+    t = calloc(1, sizeof(*t));
+    if (!t)
+        die("Cannot allocate memory");
+    t->kind = W_TARGET;
+    t->pid = pid;
+    t->pidfd = -1;
+    for (i = 0; i < 2; i++) {
+        t->streams[i].kind = W_STREAM;
+        t->streams[i].t = t;
+        t->streams[i].fd = t->streams[i].sink = -1;
+    }
+    t->next = targets;
+    targets = t;
+    return t;
+}
+
+/* Create the relay pipe of stream i (1 or 2) of t. Return an errno. */
+static int stream_open(struct target *t, int i, const char *path) {
+    struct stream *s = &t->streams[i - 1];
+    struct rr_fd *fd = &t->fds[t->nfds];
+    int pipefd[2];
+
+    s->path = strdup(path);
+    s->sink = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0666);
+    if (!s->path || s->sink < 0)
+        return errno;
+    if (pipe2(pipefd, O_CLOEXEC))
+        return errno;
+    s->fd = pipefd[0];
+    fcntl(s->fd, F_SETFL, O_NONBLOCK);
+    rr_fd_init(fd, i);
+    fd->send_fd = pipefd[1];
+    t->nfds++;
+    return 0;
+}
+
+static void target_done(struct job *job) {
+    struct target *t = job->t;
+    int i;
+
+    t->busy = 0;
+    /* Our copies of the write ends are not needed any more */
+    for (i = 0; job->kind == JOB_REDIRECT && i < job->nfds; i++)
+        if (job->fds[i].send_fd >= 0)
+            close(job->fds[i].send_fd);
+
+    if (job->err) {
+        reply(job->client_id, "error %d %s", t->pid, strerror(job->err));
+        if (job->kind == JOB_REDIRECT || job->err == ESRCH || t->exited)
+            target_free(t);
+        return;
+    }
+    if (job->kind == JOB_RESTORE) {
+        reply(job->client_id, "ok %d restored paused=%.3fms", t->pid, job->res.paused_ms);
+        target_free(t);
+        return;
+    }
+
+    for (i = 0; i < t->nfds; i++) {
+        t->fds[i] = job->fds[i];
+        t->fds[i].send_fd = -1;
+        t->fds[i].file = NULL;
+    }
+    for (i = 0; i < 2; i++)
+        if (t->streams[i].fd >= 0)
+            watch_add(t->streams[i].fd, &t->streams[i]);
+    t->pidfd = syscall(SYS_pidfd_open, t->pid, 0);
+    if (t->pidfd >= 0)
+        watch_add(t->pidfd, t);
+    reply(job->client_id, "ok %d redirected paused=%.3fms", t->pid, job->res.paused_ms);
+    if (t->exited)
+        target_free(t);
+}
+
+static void target_exited(struct target *t) {
+    if (log_opts.log_level >= RR_LOG_DEBUG)
+        fprintf(stderr, "[+] Process %d exited\n", t->pid);
+    t->exited = 1;
+    if (!t->busy)
+        target_free(t);
+}
+
+/*
+ * Requests
+ */
+
+static void target_status(unsigned long id, struct target *t) {
+    char saved[64], relay[2][MAX_LINE / 4];
+    int fds[3] = { -1, -1, -1 };
+    int i;
+
+    for (i = 0; i < t->nfds; i++)
+        fds[t->fds[i].fd] = t->fds[i].saved_fd;
+    snprintf(saved, sizeof(saved), "%d,%d,%d", fds[0], fds[1], fds[2]);
+    for (i = 0; i < 2; i++)
+        snprintf(relay[i], sizeof(relay[i]), "%s:%llu",
+                 t->streams[i].path ? t->streams[i].path : "-", t->streams[i].bytes);
+    if (t->relay)
+        reply(id, "target %d relay saved=%s out=%s err=%s%s", t->pid, saved, relay[0], relay[1],
+              t->busy ? " busy" : "");
+    else
+        reply(id, "target %d redirect saved=%s in=%s out=%s err=%s%s", t->pid, saved,
+              t->files[0] ? t->files[0] : "-", t->files[1] ? t->files[1] : "-",
+              t->files[2] ? t->files[2] : "-", t->busy ? " busy" : "");
+}
+
+static void request(struct client *c, char *line) {
+    static const char *streams[] = { "in=", "out=", "err=" };
+    const char *cmd, *arg, *files[3] = { NULL, NULL, NULL };
+    struct target *t = NULL;
+    pid_t pid = 0;
+    int err = 0, n = 0;
+    int i;
+
+    cmd = strtok(line, " \t\r");
+    if (!cmd)
+        return;
+    arg = strtok(NULL, " \t\r");
+    if (arg) {
+        pid = atoi(arg);
+        if (pid <= 0) {
+            reply(c->id, "error invalid pid %s", arg);
+            return;
+        }
+        t = find_target(pid);
+    }
+    for (arg = strtok(NULL, " \t\r"); arg; arg = strtok(NULL, " \t\r")) {
+        for (i = 0; i < 3 && strncmp(arg, streams[i], strlen(streams[i])); i++)
+            ;
+        if (i < 3)
+            files[i] = arg + strlen(streams[i]);
+        else if (!strncmp(arg, "all=", 4))
+            files[1] = files[2] = arg + 4;
+        else {
+            reply(c->id, "error invalid argument %s", arg);
+            return;
+        }
+    }
+
+    if (!strcmp(cmd, "status")) {
+        for (t = pid ? t : targets; t; t = pid ? NULL : t->next, n++)
+            target_status(c->id, t);
+        reply(c->id, "ok %d", n);
+        return;
+    }
+    if (!pid) {
+        reply(c->id, "error missing pid");
+        return;
+    }
+    if (t && t->busy) {
+        reply(c->id, "error %d busy", pid);
+        return;
+    }
+    if (!strcmp(cmd, "restore")) {
+        if (!t)
+            reply(c->id, "error %d not managed", pid);
+        else
+            submit(t, JOB_RESTORE, c->id);
+        return;
+    }
+    if (strcmp(cmd, "redirect") && strcmp(cmd, "relay")) {
+        reply(c->id, "error unknown request %s", cmd);
+        return;
+    }
+    if (t) {
+        reply(c->id, "error %d already managed, restore it first", pid);
+        return;
+    }
+    if (!files[0] && !files[1] && !files[2]) {
+        reply(c->id, "error nothing to redirect");
+        return;
+    }
+
+    t = target_new(pid);
+    t->relay = !strcmp(cmd, "relay");
+    for (i = 0; i < 3 && !err; i++) {
+        if (!files[i])
+            continue;
+        if (t->relay && !i) {
+            err = EINVAL;
+        } else if (t->relay) {
+            err = stream_open(t, i, files[i]);
+        } else {
+            t->files[i] = strdup(files[i]);
+            rr_fd_init(&t->fds[t->nfds], i);
+            t->fds[t->nfds++].file = t->files[i];
+            if (!t->files[i])
+                err = ENOMEM;
+        }
+    }
+    if (err) {
+        reply(c->id, "error %d %s", pid, strerror(err));
+        for (i = 0; i < t->nfds; i++)
+            if (t->fds[i].send_fd >= 0)
+                close(t->fds[i].send_fd);
+        target_free(t);
+        return;
+    }
+    submit(t, JOB_REDIRECT, c->id);
+}
+
+static void client_free(struct client *c) {
+    struct client **p;
+
+    for (p = &clients; *p != c; p = &(*p)->next)
+        ;
+    *p = c->next;
+    close(c->fd);
+    c->fd = -1;
+    c->next = dead_clients;
+    dead_clients = c;
+}
+
+static void free_dead(void) {
+    struct target *t;
+    struct client *c;
+    int i;
+
+    while ((t = dead_targets)) {
+        dead_targets = t->next;
+        for (i = 0; i < 2; i++)
+            free(t->streams[i].path);
+        for (i = 0; i < 3; i++)
+            free(t->files[i]);
+        free(t);
+    }
+    while ((c = dead_clients)) {
+        dead_clients = c->next;
+        free(c);
+    }
+}
+
+static void jobs_done(void) {
+    struct job *job, *next;
+
+    pthread_mutex_lock(&jobs_lock);
+    job = done;
+    done = NULL;
+    pthread_mutex_unlock(&jobs_lock);
+    for (; job; job = next) {
+        next = job->next;
+        target_done(job);
+        free(job);
+    }
+}
+
+static void client_read(struct client *c) {
+    char *line, *end;
+    ssize_t n;
+
+    n = recv(c->fd, c->buf + c->len, sizeof(c->buf) - c->len - 1, MSG_DONTWAIT);
+    if (n < 0 && (errno == EAGAIN || errno == EINTR))
+        return;
+    if (n <= 0) {
+        client_free(c);
+        return;
+    }
+    c->len += n;
+    c->buf[c->len] = '\0';
+    line = c->buf;
+    while ((end = strchr(line, '\n'))) {
+        *end = '\0';
+        request(c, line);
+        line = end + 1;
+    }
+    c->len -= line - c->buf;
+    memmove(c->buf, line, c->len);
+    if (c->len == sizeof(c->buf) - 1) {
+        reply(c->id, "error line too long");
+        client_free(c);
+    }
+}
+
+static void client_accept(int listen_fd) {
+    struct ucred cred;
+    socklen_t len = sizeof(cred);
+    struct client *c;
+    int fd;
+
+    fd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC | SOCK_NONBLOCK);
+    if (fd < 0)
+        return;
+    /* Clients can redirect any process we can trace */
+    if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) ||
+        (cred.uid && cred.uid != geteuid())) {
+        close(fd);
+        return;
+    }
+    c = calloc(1, sizeof(*c));
+    if (!c)
+        die("Cannot allocate memory");
+    c->kind = W_CLIENT;
+    c->fd = fd;
+    c->id = ++next_client_id;
+    c->next = clients;
+    clients = c;
+    watch_add(fd, c);
+}
+
+/* Put back all targets before leaving */
+static void restore_all(void) {
+    struct rr_result res;
+    int err;
+
+    while (targets) {
+        err = rr_restore(targets->pid, targets->fds, targets->nfds, &rr_opts, &res);
+        if (err && err != ESRCH)
+            fprintf(stderr, "[-] Unable to restore %d: %s\n", targets->pid, strerror(err));
+        target_free(targets);
+    }
+}
+
+int main(int argc, char **argv) {
+    static struct watch listen_watch = { W_LISTEN }, signal_watch = { W_SIGNAL },
+                        done_watch = { W_DONE };
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    const char *path = "/run/reredirectd.sock";
+    long njobs = sysconf(_SC_NPROCESSORS_ONLN);
+    struct epoll_event events[64];
+    struct target *t, *next;
+    pthread_t *threads;
+    uint64_t count;
+    sigset_t mask;
+    int listen_fd, sig_fd;
+    int stop = 0;
+    int opt, n, i;
+
+    rr_options_init(&log_opts);
+    log_opts.log = log_stderr;
+    rr_opts = log_opts;
+    while ((opt = getopt(argc, argv, "s:j:SvVh")) != -1) {
+        switch (opt) {
+            case 's':
+                path = optarg;
+                break;
+            case 'j':
+                njobs = atoi(optarg);
+                if (njobs <= 0)
+                    die("Invalid number of threads");
+                break;
+            case 'S':
+                rr_opts.stub = 1;
+                break;
+            case 'v':
+                log_opts.log_level = rr_opts.log_level = RR_LOG_DEBUG;
+                break;
+            case 'V':
+                printf("This is reredirectd version %s.\n", REREDIRECT_VERSION);
+                exit(0);
+            case 'h':
+                usage();
+                exit(0);
+            default:
+                usage();
+                exit(1);
+        }
+    }
+    rr_set_log(&log_opts);
+
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGTERM);
+    sigaddset(&mask, SIGPIPE);
+    sigprocmask(SIG_BLOCK, &mask, NULL);
+    sig_fd = signalfd(-1, &mask, SFD_CLOEXEC);
+    done_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (sig_fd < 0 || done_fd < 0 || epfd < 0)
+        die("Cannot create event loop: %s", strerror(errno));
+
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", path);
+    unlink(path);
+    umask(077);
+    listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (listen_fd < 0 || bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) ||
+        listen(listen_fd, 16))
+        die("Cannot listen on %s: %s", path, strerror(errno));
+    watch_add(listen_fd, &listen_watch);
+    watch_add(sig_fd, &signal_watch);
+    watch_add(done_fd, &done_watch);
+
+    threads = calloc(njobs, sizeof(*threads));
+    if (!threads)
+        die("Cannot allocate memory");
+    for (i = 0; i < njobs; i++)
+        if (pthread_create(&threads[i], NULL, worker, NULL))
+            die("Cannot create thread");
+
+    while (!stop) {
+        /* Without pidfd, check targets from time to time */
+        n = epoll_wait(epfd, events, sizeof(events) / sizeof(*events), 1000);
+        if (n < 0 && errno != EINTR)
+            die("epoll_wait: %s", strerror(errno));
+        for (i = 0; i < n; i++) {
+            struct watch *w = events[i].data.ptr;
+            struct stream *s;
+
+            switch (w->kind) {
+                case W_LISTEN:
+                    client_accept(listen_fd);
+                    break;
+                case W_SIGNAL:
+                    stop = 1;
+                    break;
+                case W_DONE:
+                    if (read(done_fd, &count, sizeof(count)) > 0)
+                        jobs_done();
+                    break;
+                case W_CLIENT:
+                    if (((struct client *)w)->fd >= 0)
+                        client_read((struct client *)w);
+                    break;
+                case W_STREAM:
+                    s = (struct stream *)w;
+                    if (s->fd >= 0 && !stream_relay(s)) {
+                        close(s->fd);
+                        s->fd = -1;
+                    }
+                    break;
+                case W_TARGET:
+                    if (!((struct target *)w)->dead)
+                        target_exited((struct target *)w);
+                    break;
+            }
+        }
+        free_dead();
+        for (t = targets; t; t = next) {
+            next = t->next;
+            if (t->pidfd < 0 && !t->busy && kill(t->pid, 0) && errno == ESRCH)
+                target_exited(t);
+        }
+    }
+
+    /* Finish running jobs and forget pending ones */
+    pthread_mutex_lock(&jobs_lock);
+    quit = 1;
+    pthread_cond_broadcast(&jobs_cond);
+    pthread_mutex_unlock(&jobs_lock);
+    for (i = 0; i < njobs; i++)
+        pthread_join(threads[i], NULL);
+    jobs_done();
+    restore_all();
+    free_dead();
+    unlink(path);
+    return 0;
+}
@@ -0,0 +1,385 @@
+/*
+ * Copyright (C) 2014 by Jérôme Pouiller <jezz@sysmic.org>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+/*
+ * io_uring backend of relay mode for file sinks. Data are gathered in
+ * URING_BUFS registered buffers of URING_BUF_SZ bytes. A full buffer is
+ * queued as a WRITE_FIXED at an explicit offset while the relay goes on
+ * filling the next one, so the relay keeps emptying the pipes while the
+ * disk is busy. Queued writes are submitted in batch by uring_sink_kick().
+ *
+ * With direct, the file is written with O_DIRECT: only multiples of
+ * URING_ALIGN bytes are written and the tail is carried to the next buffer
+ * (the last tail is written without O_DIRECT). If fsync_every is not 0, a
+ * linked fdatasync is queued after each fsync_every bytes.
+ *
+ * liburing is not needed: the rings are set up with the raw syscalls.
+ */
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+
+#include "reredirect.h"
+
+#ifndef SYS_io_uring_setup
+#define SYS_io_uring_setup 425
+#define SYS_io_uring_enter 426
+#define SYS_io_uring_register 427
+#endif
+
+#define URING_BUFS 8
+#define URING_BUF_SZ (1024 * 1024)
+#define URING_ALIGN 4096
+/* Writes and fsyncs in flight */
+#define URING_ENTRIES (2 * URING_BUFS)
+/* user_data of fsync requests */
+#define URING_FSYNC (~0ULL)
+
+struct uring_buf {
+    char *data;
+    size_t len;
+    int busy;
+    unsigned long long offset;
+};
+
+struct uring_sink {
+    int ring_fd;
+    void *sq_ptr, *cq_ptr;
+    size_t sq_len, cq_len, sqes_len;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    unsigned queued;
+    int inflight;
+
+    int fd;
+    int want_direct;
+    int direct;
+    unsigned long long offset;
+    unsigned long long fsync_every;
+    unsigned long long since_fsync;
+    struct uring_buf bufs[URING_BUFS];
+    int cur;
+};
+
+static int uring_enter(struct uring_sink *u, unsigned to_submit, unsigned min_complete) {
+    int ret;
+
+    do {
+        ret = syscall(SYS_io_uring_enter, u->ring_fd, to_submit, min_complete,
+                      min_complete ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+    } while (ret < 0 && errno == EINTR);
+    if (ret > 0)
+        u->queued -= ret;
+    return ret;
+}
+
+static struct io_uring_sqe *get_sqe(struct uring_sink *u) {
+    unsigned tail = *u->sq_tail;
+    unsigned idx = tail & *u->sq_mask;
+    struct io_uring_sqe *sqe = &u->sqes[idx];
+
+    memset(sqe, 0, sizeof(*sqe));
+    u->sq_array[idx] = idx;
+    __atomic_store_n(u->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    u->queued++;
+    u->inflight++;
+    return sqe;
+}
+
+/* Write the part of buf not written by a short write */
+static void write_rest(struct uring_sink *u, struct uring_buf *buf, size_t done) {
+    ssize_t ret;
+
+    if (u->direct)
+        fcntl(u->fd, F_SETFL, fcntl(u->fd, F_GETFL) & ~O_DIRECT);
+    for (; done < buf->len; done += ret) {
+        ret = pwrite(u->fd, buf->data + done, buf->len - done, buf->offset + done);
+        if (ret <= 0) {
+            error("Cannot write relayed data: %s", strerror(ret ? errno : ENOSPC));
+            break;
+        }
+    }
+    if (u->direct)
+        fcntl(u->fd, F_SETFL, fcntl(u->fd, F_GETFL) | O_DIRECT);
+}
+
+/* Handle available completions. Return the number handled. */
+static int reap(struct uring_sink *u) {
+    unsigned head = *u->cq_head;
+    struct io_uring_cqe *cqe;
+    struct uring_buf *buf;
+    int n = 0;
+
+    while (head != __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE)) {
+        cqe = &u->cqes[head & *u->cq_mask];
+        if (cqe->user_data == URING_FSYNC) {
+            if (cqe->res < 0 && cqe->res != -ECANCELED)
+                error("Cannot sync relayed data: %s", strerror(-cqe->res));
+        } else {
+            buf = &u->bufs[cqe->user_data];
+            if (cqe->res < 0)
+                error("Cannot write relayed data: %s", strerror(-cqe->res));
+            else if (cqe->res < buf->len)
+                write_rest(u, buf, cqe->res);
+            buf->busy = 0;
+            buf->len = 0;
+        }
+        head++;
+        u->inflight--;
+        n++;
+    }
+    __atomic_store_n(u->cq_head, head, __ATOMIC_RELEASE);
+    return n;
+}
+
+static int wait_one(struct uring_sink *u) {
+    while (!reap(u) && u->inflight) {
+        if (uring_enter(u, u->queued, 1) < 0 && errno != EBUSY) {
+            error("Cannot wait for io_uring: %s", strerror(errno));
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* Queue the write of the current buffer and move to the next one */
+static void queue_buf(struct uring_sink *u, int final) {
+    struct uring_buf *buf = &u->bufs[u->cur], *next;
+    struct io_uring_sqe *sqe;
+    size_t len = buf->len, tail = 0;
+
+    if (u->direct && !final) {
+        tail = len % URING_ALIGN;
+        len -= tail;
+    }
+    if (!len)
+        return;
+    u->cur = (u->cur + 1) % URING_BUFS;
+    next = &u->bufs[u->cur];
+    while (next->busy)
+        if (wait_one(u))
+            return;
+    memcpy(next->data, buf->data + len, tail);
+    next->len = tail;
+
+    /* Unaligned end of the file is written without O_DIRECT */
+    if (u->direct && len % URING_ALIGN) {
+        buf->offset = u->offset;
+        buf->len = len;
+        u->offset += len;
+        write_rest(u, buf, 0);
+        buf->len = 0;
+        return;
+    }
+
+    buf->busy = 1;
+    buf->len = len;
+    buf->offset = u->offset;
+    u->offset += len;
+    sqe = get_sqe(u);
+    sqe->opcode = IORING_OP_WRITE_FIXED;
+    sqe->fd = u->fd;
+    sqe->addr = (unsigned long)buf->data;
+    sqe->len = len;
+    sqe->off = buf->offset;
+    sqe->buf_index = buf - u->bufs;
+    sqe->user_data = buf - u->bufs;
+
+    u->since_fsync += len;
+    if (u->fsync_every && u->since_fsync >= u->fsync_every) {
+        sqe->flags |= IOSQE_IO_LINK;
+        sqe = get_sqe(u);
+        sqe->opcode = IORING_OP_FSYNC;
+        /* Also wait for the writes queued before */
+        sqe->flags |= IOSQE_IO_DRAIN;
+        sqe->fd = u->fd;
+        sqe->fsync_flags = IORING_FSYNC_DATASYNC;
+        sqe->user_data = URING_FSYNC;
+        u->since_fsync = 0;
+    }
+    /* Make room in the submission queue */
+    if (u->queued >= URING_ENTRIES - 2)
+        uring_enter(u, u->queued, 0);
+}
+
+/* Writes go at the end of fd, at explicit offsets: O_APPEND is removed */
+void uring_sink_set_fd(struct uring_sink *u, int fd) {
+    off_t end = lseek(fd, 0, SEEK_END);
+    int flags = fcntl(fd, F_GETFL) & ~O_APPEND;
+
+    u->fd = fd;
+    u->offset = end < 0 ? 0 : end;
+    u->direct = u->want_direct;
+    if (u->direct && u->offset % URING_ALIGN) {
+        debug("Size of fd %d is not aligned, not using O_DIRECT", fd);
+        u->direct = 0;
+    }
+    if (fcntl(fd, F_SETFL, flags | (u->direct ? O_DIRECT : 0))) {
+        debug("Cannot use O_DIRECT on fd %d: %s", fd, strerror(errno));
+        u->direct = 0;
+        fcntl(fd, F_SETFL, flags);
+    }
+}
+
+/* Return NULL if io_uring is not available */
+struct uring_sink *uring_sink_new(int fd, int direct, unsigned long long fsync_every) {
+    struct io_uring_params p;
+    struct iovec iov[URING_BUFS];
+    struct uring_sink *u;
+    int i;
+
+    u = calloc(1, sizeof(*u));
+    if (!u)
+        return NULL;
+    memset(&p, 0, sizeof(p));
+    u->ring_fd = syscall(SYS_io_uring_setup, URING_ENTRIES, &p);
+    if (u->ring_fd < 0) {
+        debug("io_uring is not available: %s", strerror(errno));
+        free(u);
+        return NULL;
+    }
+    fcntl(u->ring_fd, F_SETFD, FD_CLOEXEC);
+
+    u->sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    u->cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    u->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+    u->sq_ptr = mmap(NULL, u->sq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                     u->ring_fd, IORING_OFF_SQ_RING);
+    u->cq_ptr = mmap(NULL, u->cq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                     u->ring_fd, IORING_OFF_CQ_RING);
+    u->sqes = mmap(NULL, u->sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                   u->ring_fd, IORING_OFF_SQES);
+    if (u->sq_ptr == MAP_FAILED || u->cq_ptr == MAP_FAILED || u->sqes == MAP_FAILED) {
+        debug("Cannot map io_uring: %s", strerror(errno));
+        goto err;
+    }
+    u->sq_head = u->sq_ptr + p.sq_off.head;
+    u->sq_tail = u->sq_ptr + p.sq_off.tail;
+    u->sq_mask = u->sq_ptr + p.sq_off.ring_mask;
+    u->sq_array = u->sq_ptr + p.sq_off.array;
+    u->cq_head = u->cq_ptr + p.cq_off.head;
+    u->cq_tail = u->cq_ptr + p.cq_off.tail;
+    u->cq_mask = u->cq_ptr + p.cq_off.ring_mask;
+    u->cqes = u->cq_ptr + p.cq_off.cqes;
+
+    for (i = 0; i < URING_BUFS; i++) {
+        if (posix_memalign((void **)&u->bufs[i].data, URING_ALIGN, URING_BUF_SZ))
+            goto err;
+        iov[i].iov_base = u->bufs[i].data;
+        iov[i].iov_len = URING_BUF_SZ;
+    }
+    if (syscall(SYS_io_uring_register, u->ring_fd, IORING_REGISTER_BUFFERS, iov, URING_BUFS)) {
+        debug("Cannot register io_uring buffers: %s", strerror(errno));
+        goto err;
+    }
+
+    u->want_direct = direct;
+    u->fsync_every = fsync_every;
+    uring_sink_set_fd(u, fd);
+    return u;
+
+ err:
+    uring_sink_free(u);
+    return NULL;
+}
+
+/* Free space in the current buffer. Data written there are added by commit. */
+char *uring_sink_buffer(struct uring_sink *u, size_t *space) {
+    struct uring_buf *buf = &u->bufs[u->cur];
+
+    *space = URING_BUF_SZ - buf->len;
+    return buf->data + buf->len;
+}
+
+void uring_sink_commit(struct uring_sink *u, size_t n) {
+    struct uring_buf *buf = &u->bufs[u->cur];
+
+    buf->len += n;
+    if (buf->len == URING_BUF_SZ)
+        queue_buf(u, 0);
+}
+
+void uring_sink_write(struct uring_sink *u, const void *data, size_t n) {
+    size_t space, part;
+    char *p;
+
+    while (n) {
+        p = uring_sink_buffer(u, &space);
+        part = n < space ? n : space;
+        memcpy(p, data, part);
+        uring_sink_commit(u, part);
+        data = (const char *)data + part;
+        n -= part;
+    }
+}
+
+size_t uring_sink_pending(struct uring_sink *u) {
+    return u->bufs[u->cur].len;
+}
+
+/* Queue the partial buffer */
+void uring_sink_submit(struct uring_sink *u) {
+    queue_buf(u, 0);
+}
+
+/* Submit queued writes and handle completions, without waiting */
+void uring_sink_kick(struct uring_sink *u) {
+    if (u->queued)
+        uring_enter(u, u->queued, 0);
+    reap(u);
+}
+
+/* Write everything and wait for it */
+void uring_sink_flush(struct uring_sink *u) {
+    queue_buf(u, 1);
+    while (u->inflight)
+        if (wait_one(u))
+            break;
+}
+
+void uring_sink_free(struct uring_sink *u) {
+    int i;
+
+    if (u->sq_tail)
+        uring_sink_flush(u);
+    if (u->sq_ptr && u->sq_ptr != MAP_FAILED)
+        munmap(u->sq_ptr, u->sq_len);
+    if (u->cq_ptr && u->cq_ptr != MAP_FAILED)
+        munmap(u->cq_ptr, u->cq_len);
+    if (u->sqes && u->sqes != MAP_FAILED)
+        munmap(u->sqes, u->sqes_len);
+    for (i = 0; i < URING_BUFS; i++)
+        free(u->bufs[i].data);
+    close(u->ring_fd);
+    free(u);
+}
@@ -0,0 +1 @@
+#define REREDIRECT_VERSION "df85"